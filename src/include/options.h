@@ -30,12 +30,29 @@ struct opts_s {           /* structure describing run-time options */
 	unsigned char wait;            /* wait for transfer before display */
 	unsigned char linemode;        /* count lines instead of bytes */
 	unsigned char null;            /* lines are null-terminated */
+	unsigned char line_cache;      /* cache line counts in xattrs */
 	unsigned char no_op;           /* do nothing other than pipe data */
 	unsigned long long rate_limit; /* rate limit, in bytes per second */
+	char *rate_schedule;           /* rate limit schedule, if any */
+	unsigned long long rate_burst; /* rate limit burst size (0=auto) */
+	char *rate_group;              /* rate group name, if any */
+	unsigned int rate_group_weight;/* weight within rate group */
+	double deadline;               /* seconds to finish within (0=none) */
 	unsigned long long buffer_size;/* buffer size, in bytes (0=default) */
+	unsigned long long pipe_size;  /* pipe size, in bytes (0=auto) */
 	unsigned int remote;           /* PID of pv to update settings of */
 	unsigned long long size;       /* total size of data */
 	unsigned char no_splice;       /* flag set if never to use splice */
+	unsigned char splice_pipe;     /* splice via a pipe if neither is one */
+	unsigned char direct_io;       /* use O_DIRECT where possible */
+	unsigned char drop_cache;      /* drop input from the page cache */
+	unsigned char write_behind;    /* sync output as it is written */
+	unsigned char flush;           /* flush output to disk at the end */
+	unsigned char sparse;          /* skip holes and zero blocks */
+	unsigned char huge_pages;      /* use huge pages for the buffer */
+	unsigned char mlock;           /* lock the buffer into memory */
+	unsigned char io_uring;        /* flag set to use io_uring */
+	unsigned char threaded;        /* flag set to use threads */
 	unsigned char skip_errors;     /* skip read errors flag */
 	unsigned char stop_at_size;    /* set if we stop at "size" bytes */
 	double interval;               /* interval between updates */
@@ -33,7 +33,13 @@ extern "C" {
 #define PV_DISPLAY_OUTPUTBUF	256
 #define PV_DISPLAY_FINETA	512
 
-#define RATE_GRANULARITY	100000	 /* usec between -L rate chunks */
+#define RATE_PACE_USEC		1000	 /* usec of -L rate to send at once */
+#define RATE_BURST_USEC		100000	 /* usec of -L rate in default burst */
+#define RATE_GROUP_MEMBERS	64	 /* max processes in a rate group */
+#define RATE_GROUP_ACTIVE_USEC	500000	 /* usec a held back member counts */
+#define RATE_GROUP_SAMPLE_USEC	100000	 /* usec between group rate updates */
+#define RATE_SCHEDULE_USEC	100000	 /* usec between -L schedule checks */
+#define DEADLINE_MARGIN_MAX	60	 /* max sec to aim to finish early by */
 #define REMOTE_INTERVAL		100000	 /* usec between checks for -R */
 #define BUFFER_SIZE		409600	 /* default transfer buffer size */
 #define BUFFER_SIZE_MAX		524288	 /* max auto transfer buffer size */
@@ -41,8 +47,24 @@ extern "C" {
 #define MAX_WRITE_AT_ONCE	524288	 /* max to write() in one go */
 #define TRANSFER_READ_TIMEOUT	90000	 /* usec to time reads out at */
 #define TRANSFER_WRITE_TIMEOUT	900000	 /* usec to time writes out at */
-
-#define MAXIMISE_BUFFER_FILL	1
+#define URING_MAX_READS		4	 /* max io_uring reads in flight */
+#define URING_READ_CHUNK	131072	 /* max size of each io_uring read */
+#define LINECOUNT_CHUNK_SIZE	16777216 /* bytes per line counting chunk */
+#define LINECOUNT_READ_SIZE	262144	 /* bytes per line counting read */
+#define LINECOUNT_MAX_THREADS	16	 /* max line counting threads */
+#define READAHEAD_MIN		1048576	 /* min bytes to advise readahead of */
+#define READAHEAD_MAX		67108864 /* max bytes to advise readahead of */
+#define READAHEAD_USEC		1000000	 /* usec of input to read ahead */
+#define DROP_BEHIND_CHUNK	2097152	 /* bytes to drop from cache at once */
+#define WRITE_BEHIND_CHUNK	8388608	 /* bytes of output to sync at once */
+#define SPARSE_BLOCK		4096	 /* size of zero blocks to skip */
+#define HUGE_PAGE_SIZE		2097152	 /* huge page size to align buffer to */
+#define PIPE_SIZE_MAX		1073741824 /* largest pipe size to ask for */
+#define BUFFER_ADAPT_MIN	65536	 /* min adaptive transfer buffer size */
+#define BUFFER_ADAPT_MAX	16777216 /* max adaptive transfer buffer size */
+#define BUFFER_ADAPT_USEC	1000000	 /* usec between buffer size checks */
+#define BUFFER_ADAPT_IDLE	5	 /* idle checks before buffer shrinks */
+#define BUFFER_ADAPT_CGROUP	16	 /* max 1/this of cgroup memory limit */
 
 
 /*
@@ -64,12 +86,31 @@ struct pvstate_s {
 	unsigned char wait;              /* wait for data before display */
 	unsigned char linemode;          /* count lines instead of bytes */
 	unsigned char null;              /* lines are null-terminated */
+	unsigned char line_cache;        /* cache line counts in xattrs */
 	unsigned char no_op;             /* do nothing other than pipe data */
 	unsigned char skip_errors;       /* skip read errors flag */
 	unsigned char stop_at_size;      /* set if we stop at "size" bytes */
 	unsigned char no_splice;         /* never use splice() */
+	unsigned char splice_pipe;       /* splice() via a pipe if needed */
+	unsigned char direct_io;         /* use O_DIRECT where possible */
+	unsigned char drop_cache;        /* drop input from the page cache */
+	unsigned char write_behind;      /* sync output as it is written */
+	unsigned char flush;             /* flush output to disk at the end */
+	unsigned char sparse;            /* skip holes and zero blocks */
+	unsigned char huge_pages;        /* use huge pages for the buffer */
+	unsigned char mlock;             /* lock the buffer into memory */
+	unsigned char io_uring;          /* use io_uring for reads/writes */
+	unsigned char threaded;          /* use reader and writer threads */
 	unsigned long long rate_limit;   /* rate limit, in bytes per second */
+	unsigned long long rate_burst;   /* rate limit burst size (0=auto) */
+	const char *rate_group_name;     /* rate group to share limit with */
+	unsigned int rate_group_weight;  /* our weight in the rate group */
+	unsigned long long rate_limit_given; /* -L, to limit deadline rate */
+	const char *rate_schedule_spec;  /* -L schedule, if one was given */
+	struct timeval deadline;         /* when to aim to finish, or 0 */
 	unsigned long long target_buffer_size;  /* buffer size (0=default) */
+	unsigned char buffer_adaptive;   /* set if buffer size may change */
+	unsigned long long pipe_size;    /* pipe size to ask for (0=auto) */
 	unsigned long long size;         /* total size of data */
 	double interval;                 /* interval between updates */
 	double delay_start;              /* delay before first display */
@@ -165,17 +206,24 @@ struct pvstate_s {
 	 * pv_transfer will try to reallocate transfer_buffer to make
 	 * buffer_size equal to pv__target_bufsize.
 	 *
-	 * Data from the input files is read into the buffer; read_position
-	 * is the offset in the buffer that we've read data up to.
+	 * The buffer is used as a ring, so that data never has to be moved
+	 * around inside it.  Data from the input files is read into the
+	 * buffer; read_position is the position in the ring that we've read
+	 * data up to.
 	 *
 	 * Data is written to the output from the buffer, and write_position
-	 * is the offset in the buffer that we've written data up to.  It
-	 * will always be less than or equal to read_position.
+	 * is the position in the ring that we've written data up to.  It
+	 * will always be less than or equal to read_position, and no more
+	 * than buffer_size behind it.
+	 *
+	 * Both positions only ever increase, until the buffer is emptied and
+	 * they are reset to zero; the offset in the buffer of a position is
+	 * the position modulo buffer_size.
 	 */
 	unsigned char *transfer_buffer;	 /* data transfer buffer */
 	unsigned long long buffer_size;	 /* size of buffer */
-	unsigned long read_position;	 /* amount of data in buffer */
-	unsigned long write_position;	 /* buffered data written */
+	unsigned long long read_position; /* amount of data in buffer */
+	unsigned long long write_position; /* buffered data written */
 
 	/*
 	 * While reading from a file descriptor we keep track of how many
@@ -199,11 +247,187 @@ struct pvstate_s {
 	 * used; splice_failed_fd is the file descriptor that splice() last
 	 * failed on, so that we don't keep trying to use it on an fd that
 	 * doesn't support it, and splice_used is set to 1 if splice() was
-	 * used this time within pv_transfer().
+	 * used this time within pv_transfer().  The same applies to
+	 * copy_file_range() and sendfile(), which are used instead of
+	 * splice() when they suit the input and output better;
+	 * splice_method says which call is being used for the input file
+	 * splice_checked_fd.
 	 */
 	int splice_failed_fd;
 	int splice_used;
+	int splice_checked_fd;
+	int splice_method;
+	/*
+	 * With --splice-pipe, data is spliced from input to output through
+	 * this pipe when neither of them is a pipe; splice_pipe_fill is the
+	 * number of bytes currently sitting in it.
+	 */
+	int splice_pipe_fd[2];
+	unsigned long splice_pipe_fill;
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+	/*
+	 * If io_uring is enabled, reads into and writes from the transfer
+	 * buffer are queued on an io_uring instead of being done with
+	 * read() and write(), so that reads and writes can be in flight at
+	 * the same time.  The ring is set up on first use; if that fails,
+	 * or if a queued read fails, uring_failed_fd is set to the current
+	 * fd so we fall back to read() and write() until the next input
+	 * file, in the same way as splice_failed_fd.
+	 */
+	struct pvuring_s *uring;
+	int uring_failed_fd;
 #endif
+	/*
+	 * In threaded mode, data is moved by a reader thread and a writer
+	 * thread, using the transfer buffer as a ring, instead of by
+	 * pv_transfer(); this is the state they share with the main loop,
+	 * which is only non-NULL while they are in use (see thread.c).
+	 */
+	struct pvthreads_s *threads;
+	/*
+	 * With --direct-io, regular files and block devices are read and
+	 * written with O_DIRECT.  direct_input_fd is the input file
+	 * descriptor it is on (-1 if none), direct_output is set while it
+	 * is on for stdout, and direct_align is the alignment - the page
+	 * size - that the transfer buffer, the sizes of reads and writes,
+	 * and positions in the buffer must have while it is in use.
+	 */
+	int direct_input_fd;
+	int direct_output;
+	unsigned long direct_align;
+	/*
+	 * With --write-behind, when stdout is a regular file or block
+	 * device, writeback of each WRITE_BEHIND_CHUNK of output is started
+	 * once it has been written, and the chunk before it is waited for
+	 * and dropped from the page cache, so that dirty output never
+	 * builds up.  writebehind_active is set while this is being done;
+	 * the rest are offsets in the output - where we started, how far
+	 * we have written, how far writeback has been started, and how far
+	 * it is known to have finished.
+	 */
+	int writebehind_active;
+	unsigned long long writebehind_start;
+	unsigned long long writebehind_offset;
+	unsigned long long writebehind_queued;
+	unsigned long long writebehind_durable;
+	/*
+	 * With --flush, this is the flush of the output to disk that is in
+	 * progress after the last write (see transfer.c); it is NULL
+	 * otherwise.
+	 */
+	struct pvflush_s *flushing;
+	/*
+	 * If the total size of the input files is known, prealloc_size is
+	 * set to it, and if the output is a regular file, that much space
+	 * is allocated for it before the transfer starts; prealloc_end is
+	 * then the end of the allocated space, so that any left unused can
+	 * be released at the end.
+	 */
+	unsigned long long prealloc_size;
+	unsigned long long prealloc_end;
+	/*
+	 * With --sparse, holes in regular input files are found with
+	 * SEEK_DATA and SEEK_HOLE instead of being read, and blocks of
+	 * zeroes are skipped over with lseek() instead of being written,
+	 * if the output is a regular file that we are writing past the end
+	 * of.  sparse_input_fd is the input file this applies to (-1 if
+	 * none), sparse_in_offset is our offset in it, and sparse_next_hole
+	 * is where the next hole in it starts, as far as we know;
+	 * sparse_output is set if holes can be left in the output, and
+	 * sparse_out_offset is our offset in that.
+	 */
+	int sparse_input_fd;
+	unsigned long long sparse_in_offset;
+	unsigned long long sparse_next_hole;
+	int sparse_output;
+	unsigned long long sparse_out_offset;
+	/*
+	 * While reading a regular input file, posix_fadvise() is used to
+	 * ask for readahead of about READAHEAD_USEC worth of data at the
+	 * rate it is being read, and with --drop-cache, to drop what has
+	 * already been read from the page cache.  advise_fd is the input
+	 * file this applies to (-1 if none), advise_offset is how far into
+	 * it we have read, advise_ahead is how far readahead has been asked
+	 * for, advise_dropped is how far the cache has been dropped,
+	 * advise_size is the size of the file, and advise_rate is the read
+	 * rate in bytes per second, last measured at advise_sample_offset
+	 * and advise_sample_time.
+	 */
+	int advise_fd;
+	unsigned long long advise_size;
+	unsigned long long advise_offset;
+	unsigned long long advise_ahead;
+	unsigned long long advise_dropped;
+	unsigned long long advise_sample_offset;
+	struct timeval advise_sample_time;
+	long double advise_rate;
+	/*
+	 * If the lines in the input are being counted in the background to
+	 * work out the total size, this points to the count in progress
+	 * (see file.c); it is NULL otherwise.
+	 */
+	struct pvlinecount_s *linecount;
+	/*
+	 * With --rate-limit, rate_tokens is the number of bytes (or lines)
+	 * in the token bucket, which is how many may be sent now; it was
+	 * last topped up at rate_time, at rate_current per second (see
+	 * ratelimit.c).
+	 */
+	long double rate_tokens;
+	long double rate_current;
+	struct timeval rate_time;
+	/*
+	 * With --deadline, rate_deadline is the rate needed to finish in
+	 * time, which rate_limit is kept just above (see
+	 * pv_ratelimit_deadline()); it is zero when there is no need to
+	 * hold back.
+	 */
+	long double rate_deadline;
+	/*
+	 * With a schedule given to --rate-limit, rate_schedule is its
+	 * rate_schedule_count entries in time order, parsed on first use
+	 * (rate_schedule_loaded); rate_schedule_applied is the rate it last
+	 * set, at rate_schedule_checked (see pv_ratelimit_schedule()).
+	 */
+	pv_schedule_t *rate_schedule;
+	int rate_schedule_count;
+	int rate_schedule_loaded;
+	unsigned long long rate_schedule_applied;
+	struct timeval rate_schedule_checked;
+#ifdef HAVE_IPC
+	/*
+	 * With --rate-group, rate_group is the group's shared memory, with
+	 * ID rate_group_shmid, in which we have slot rate_group_slot; it is
+	 * NULL if we are not in a group, and rate_group_joined is set once
+	 * we have tried to join.  rate_group_sent is how much we have sent
+	 * since our rate was last published to the group at
+	 * rate_group_sampled.
+	 */
+	struct pvrategroup_s *rate_group;
+	int rate_group_joined;
+	int rate_group_shmid;
+	int rate_group_slot;
+	long double rate_group_sent;
+	struct timeval rate_group_sampled;
+#endif				/* HAVE_IPC */
+	/*
+	 * Unless a buffer size was given, the buffer size is adjusted
+	 * between adapt_min and adapt_max according to how full it gets
+	 * (see pv_transfer_buffer_adapt()); adapt_calls is the number of
+	 * calls to pv_transfer() since the last check at adapt_check,
+	 * adapt_full is how many of those found the buffer too full to
+	 * read into, adapt_peak is the most that was in the buffer, and
+	 * adapt_idle is the number of checks in a row that found it
+	 * mostly empty.
+	 */
+	unsigned long long adapt_min;
+	unsigned long long adapt_max;
+	struct timeval adapt_check;
+	unsigned long adapt_calls;
+	unsigned long adapt_full;
+	unsigned long long adapt_peak;
+	int adapt_idle;
 	long to_write;			 /* max to write this time around */
 	long written;			 /* bytes sent to stdout this time */
 };
@@ -227,10 +451,46 @@ typedef struct pvwatchfd_s *pvwatchfd_t;
 void pv_error(pvstate_t, char *, ...);
 
 int pv_main_loop(pvstate_t);
+void pv_monotonic_time(struct timeval *);
 void pv_display(pvstate_t, long double, long long, long long);
 long pv_transfer(pvstate_t, int, int *, int *, unsigned long long, long *);
+void pv_transfer_fini(pvstate_t);
+unsigned char *pv_transfer_buffer_alloc(pvstate_t, unsigned long long);
+void pv_transfer_buffer_free(pvstate_t, unsigned char *, unsigned long long);
+void pv_transfer_buffer_adapt(pvstate_t, struct timeval *);
+int pv_transfer_direct_set(int, int);
+void pv_transfer_direct_output(pvstate_t);
+void pv_transfer_pipe_resize(pvstate_t, int);
+void pv_transfer_writebehind_init(pvstate_t);
+int pv_transfer_preallocate(pvstate_t);
+void pv_transfer_sparse_init(pvstate_t);
+void pv_transfer_sparse_finish(pvstate_t);
+void pv_transfer_writebehind(pvstate_t, long);
+void pv_transfer_writebehind_finish(pvstate_t);
+int pv_transfer_flush_start(pvstate_t);
+int pv_transfer_flush_check(pvstate_t, unsigned long long *);
+long pv_transfer_read_error(pvstate_t, int, unsigned long);
 void pv_set_buffer_size(unsigned long long, int);
 int pv_next_file(pvstate_t, int, int);
+void pv_file_advise(pvstate_t, int, unsigned long);
+void pv_calc_total_size_check(pvstate_t, int);
+void pv_calc_total_size_fini(pvstate_t);
+
+unsigned long long pv_ratelimit_allowed(pvstate_t, struct timeval *);
+void pv_ratelimit_used(pvstate_t, long);
+int pv_ratelimit_wait(pvstate_t, struct timeval *);
+void pv_ratelimit_schedule(pvstate_t, struct timeval *);
+void pv_ratelimit_deadline(pvstate_t, struct timeval *, long long);
+void pv_ratelimit_fini(pvstate_t);
+
+unsigned long pv_count_byte(const unsigned char *, size_t, unsigned char);
+size_t pv_count_records(const unsigned char *, size_t, unsigned char,
+			unsigned long long *);
+int pv_zero_block(const unsigned char *, size_t);
+
+int pv_thread_start(pvstate_t, int);
+long pv_thread_transfer(pvstate_t, int *, int *, unsigned long long, long *);
+void pv_thread_fini(pvstate_t);
 
 void pv_crs_fini(pvstate_t);
 void pv_crs_init(pvstate_t);
@@ -251,7 +511,7 @@ int pv_remote_set(pvstate_t);
 int pv_watchfd_info(pvstate_t, pvwatchfd_t, int);
 int pv_watchfd_changed(pvwatchfd_t);
 long long pv_watchfd_position(pvwatchfd_t);
-int pv_watchpid_scanfds(pvstate_t, pvstate_t, unsigned int, int *, pvwatchfd_t *, pvstate_t *, int *);
+int pv_watchpid_scanfds(pvstate_t, pvstate_t, unsigned int, int *, pvwatchfd_t *, pvstate_t *, int **, int *);
 void pv_watchpid_setname(pvstate_t, pvwatchfd_t);
 
 #ifdef __cplusplus
@@ -23,6 +23,15 @@ typedef enum {
   PV_NUMTYPE_DOUBLE
 } pv_numtype_t;
 
+/*
+ * An entry in a rate limit schedule, from pv_getnum_schedule().
+ */
+typedef struct {
+  long at;                  /* time of day, as seconds after midnight */
+  unsigned long long rate;  /* rate limit from then on (0=none) */
+  double ramp;              /* seconds to change to the new rate over */
+} pv_schedule_t;
+
 
 /*
  * Simple string functions for processing numbers.
@@ -49,6 +58,26 @@ extern long long pv_getnum_ll(const char *);
  */
 extern int pv_getnum_check(const char *, pv_numtype_t);
 
+/*
+ * Return the time of day "HH:MM[:SS]" in the given string as seconds after
+ * midnight, or -1 if it is not valid.
+ */
+extern long pv_getnum_clock(const char *);
+
+/*
+ * Return the duration in the given string, a number of seconds with an
+ * optional "s", "m", "h", or "d" suffix, as seconds, or -1 if it is not
+ * valid.
+ */
+extern double pv_getnum_duration(const char *);
+
+/*
+ * Parse the rate limit schedule in the given string into the given array
+ * of entries, of the given size, returning the number of entries, or -1 if
+ * it is not valid.  The array may be NULL to just check the schedule.
+ */
+extern int pv_getnum_schedule(const char *, pv_schedule_t *, int);
+
 /*
  * Main PV functions.
  */
@@ -79,12 +108,28 @@ extern void pv_state_wait_set(pvstate_t, unsigned char);
 extern void pv_state_delay_start_set(pvstate_t, double);
 extern void pv_state_linemode_set(pvstate_t, unsigned char);
 extern void pv_state_null_set(pvstate_t, unsigned char);
+extern void pv_state_line_cache_set(pvstate_t, unsigned char);
 extern void pv_state_no_op_set(pvstate_t, unsigned char);
 extern void pv_state_skip_errors_set(pvstate_t, unsigned char);
 extern void pv_state_stop_at_size_set(pvstate_t, unsigned char);
 extern void pv_state_rate_limit_set(pvstate_t, unsigned long long);
+extern void pv_state_rate_burst_set(pvstate_t, unsigned long long);
+extern void pv_state_rate_group_set(pvstate_t, const char *, unsigned int);
+extern void pv_state_rate_schedule_set(pvstate_t, const char *);
+extern void pv_state_deadline_set(pvstate_t, double);
 extern void pv_state_target_buffer_size_set(pvstate_t, unsigned long long);
+extern void pv_state_pipe_size_set(pvstate_t, unsigned long long);
 extern void pv_state_no_splice_set(pvstate_t, unsigned char);
+extern void pv_state_splice_pipe_set(pvstate_t, unsigned char);
+extern void pv_state_direct_io_set(pvstate_t, unsigned char);
+extern void pv_state_drop_cache_set(pvstate_t, unsigned char);
+extern void pv_state_write_behind_set(pvstate_t, unsigned char);
+extern void pv_state_flush_set(pvstate_t, unsigned char);
+extern void pv_state_sparse_set(pvstate_t, unsigned char);
+extern void pv_state_huge_pages_set(pvstate_t, unsigned char);
+extern void pv_state_mlock_set(pvstate_t, unsigned char);
+extern void pv_state_io_uring_set(pvstate_t, unsigned char);
+extern void pv_state_threaded_set(pvstate_t, unsigned char);
 extern void pv_state_size_set(pvstate_t, unsigned long long);
 extern void pv_state_interval_set(pvstate_t, double);
 extern void pv_state_width_set(pvstate_t, unsigned int);
@@ -106,6 +151,12 @@ extern void pv_screensize(unsigned int *width, unsigned int *height);
  */
 extern unsigned long long pv_calc_total_size(pvstate_t);
 
+/*
+ * Return nonzero if the total size is still being calculated in the
+ * background.
+ */
+extern int pv_calc_total_size_pending(pvstate_t);
+
 /*
  * Set up signal handlers ready for running the main loop.
  */
@@ -63,6 +63,8 @@ void display_help(void)
 		 N_("count lines instead of bytes")},
 		{"-0", "--null", 0,
 		 N_("lines are null-terminated")},
+		{"-k", "--line-cache", 0,
+		 N_("cache line counts in extended attributes")},
 		{"-i", "--interval", N_("SEC"),
 		 N_("update every SEC seconds")},
 		{"-w", "--width", N_("WIDTH"),
@@ -78,10 +80,38 @@ void display_help(void)
 		{"", 0, 0, 0},
 		{"-L", "--rate-limit", N_("RATE"),
 		 N_("limit transfer to RATE bytes per second")},
+		{"-x", "--rate-burst", N_("BYTES"),
+		 N_("let rate limit allow bursts of up to BYTES")},
+		{"-G", "--rate-group", N_("NAME[:WEIGHT]"),
+		 N_("share rate limit with other processes in group NAME")},
+		{"-z", "--deadline", N_("WHEN"),
+		 N_("limit rate so as to finish just before WHEN")},
 		{"-B", "--buffer-size", N_("BYTES"),
 		 N_("use a buffer size of BYTES")},
+		{"-j", "--pipe-size", N_("BYTES"),
+		 N_("make pipes on stdin and stdout hold BYTES")},
 		{"-C", "--no-splice", 0,
-		 N_("never use splice(), always use read/write")},
+		 N_("never use splice() or similar, always use read/write")},
+		{"-J", "--splice-pipe", 0,
+		 N_("splice() through a pipe if neither end is a pipe")},
+		{"-K", "--direct-io", 0,
+		 N_("bypass the page cache with O_DIRECT")},
+		{"-X", "--drop-cache", 0,
+		 N_("drop input files from the page cache once read")},
+		{"-Y", "--write-behind", 0,
+		 N_("flush output to disk as it is written")},
+		{"-y", "--flush", 0,
+		 N_("flush output to disk at the end, showing progress")},
+		{"-Z", "--sparse", 0,
+		 N_("skip holes in input, and leave holes in output")},
+		{"-u", "--huge-pages", 0,
+		 N_("use huge pages for the transfer buffer")},
+		{"-m", "--mlock", 0,
+		 N_("lock the transfer buffer into memory")},
+		{"-U", "--io-uring", 0,
+		 N_("queue reads and writes with io_uring")},
+		{"-M", "--threaded", 0,
+		 N_("read and write in separate threads")},
 		{"-E", "--skip-errors", 0,
 		 N_("skip read errors in input")},
 		{"-S", "--stop-at-size", 0,
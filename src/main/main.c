@@ -106,22 +106,28 @@ int main(int argc, char **argv)
 	 */
 	pv_state_inputfiles(state, opts->argc,
 			    (const char **) (opts->argv));
+	pv_state_linemode_set(state, opts->linemode);
+	pv_state_null_set(state, opts->null);
+	pv_state_line_cache_set(state, opts->line_cache);
 
 	if (0 == opts->watch_pid) {
 		/*
-		 * If no size was given, and we're not in line mode, try to
-		 * calculate the total size.
+		 * If no size was given, try to calculate the total size -
+		 * in line mode, this means counting the lines in the input
+		 * files.
 		 */
-		if ((0 == opts->size) && (0 == opts->linemode)) {
+		if (0 == opts->size) {
 			opts->size = pv_calc_total_size(state);
 			debug("%s: %llu", "no size given - calculated",
 			      opts->size);
 		}
 
 		/*
-		 * If the size is unknown, we cannot have an ETA.
+		 * If the size is unknown, and is not going to be known
+		 * later, we cannot have an ETA.
 		 */
-		if (opts->size < 1) {
+		if ((opts->size < 1)
+		    && (0 == pv_calc_total_size_pending(state))) {
 			opts->eta = 0;
 			debug("%s", "size unknown - ETA disabled");
 		}
@@ -190,13 +196,27 @@ int main(int argc, char **argv)
 	pv_state_numeric_set(state, opts->numeric);
 	pv_state_wait_set(state, opts->wait);
 	pv_state_delay_start_set(state, opts->delay_start);
-	pv_state_linemode_set(state, opts->linemode);
-	pv_state_null_set(state, opts->null);
 	pv_state_skip_errors_set(state, opts->skip_errors);
 	pv_state_stop_at_size_set(state, opts->stop_at_size);
 	pv_state_rate_limit_set(state, opts->rate_limit);
+	pv_state_rate_schedule_set(state, opts->rate_schedule);
+	pv_state_rate_burst_set(state, opts->rate_burst);
+	pv_state_rate_group_set(state, opts->rate_group,
+				opts->rate_group_weight);
+	pv_state_deadline_set(state, opts->deadline);
 	pv_state_target_buffer_size_set(state, opts->buffer_size);
+	pv_state_pipe_size_set(state, opts->pipe_size);
 	pv_state_no_splice_set(state, opts->no_splice);
+	pv_state_splice_pipe_set(state, opts->splice_pipe);
+	pv_state_direct_io_set(state, opts->direct_io);
+	pv_state_drop_cache_set(state, opts->drop_cache);
+	pv_state_write_behind_set(state, opts->write_behind);
+	pv_state_flush_set(state, opts->flush);
+	pv_state_sparse_set(state, opts->sparse);
+	pv_state_huge_pages_set(state, opts->huge_pages);
+	pv_state_mlock_set(state, opts->mlock);
+	pv_state_io_uring_set(state, opts->io_uring);
+	pv_state_threaded_set(state, opts->threaded);
 	pv_state_size_set(state, opts->size);
 	pv_state_name_set(state, opts->name);
 	pv_state_format_string_set(state, opts->format);
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -67,14 +68,29 @@ opts_t opts_parse(int argc, char **argv)
 		{"size", 1, 0, 's'},
 		{"line-mode", 0, 0, 'l'},
 		{"null", 0, 0, '0'},
+		{"line-cache", 0, 0, 'k'},
 		{"interval", 1, 0, 'i'},
 		{"width", 1, 0, 'w'},
 		{"height", 1, 0, 'H'},
 		{"name", 1, 0, 'N'},
 		{"format", 1, 0, 'F'},
 		{"rate-limit", 1, 0, 'L'},
+		{"rate-burst", 1, 0, 'x'},
+		{"rate-group", 1, 0, 'G'},
+		{"deadline", 1, 0, 'z'},
 		{"buffer-size", 1, 0, 'B'},
+		{"pipe-size", 1, 0, 'j'},
 		{"no-splice", 0, 0, 'C'},
+		{"splice-pipe", 0, 0, 'J'},
+		{"direct-io", 0, 0, 'K'},
+		{"drop-cache", 0, 0, 'X'},
+		{"write-behind", 0, 0, 'Y'},
+		{"flush", 0, 0, 'y'},
+		{"sparse", 0, 0, 'Z'},
+		{"huge-pages", 0, 0, 'u'},
+		{"mlock", 0, 0, 'm'},
+		{"io-uring", 0, 0, 'U'},
+		{"threaded", 0, 0, 'M'},
 		{"skip-errors", 0, 0, 'E'},
 		{"stop-at-size", 0, 0, 'S'},
 		{"remote", 1, 0, 'R'},
@@ -85,10 +101,12 @@ opts_t opts_parse(int argc, char **argv)
 	int option_index = 0;
 #endif
 	char *short_options =
-	    "hVpteIrabTA:fnqcWD:s:l0i:w:H:N:F:L:B:CESR:P:d:";
+	    "hVpteIrabTA:fnqcWD:s:l0ki:w:H:N:F:L:x:G:z:B:j:CJKXYyZumUMESR:P:d:";
 	int c, numopts;
 	unsigned int check_pid;
 	int check_fd;
+	char *check_weight;
+	long check_clock;
 	opts_t opts;
 	char *ptr;
 
@@ -144,8 +162,9 @@ opts_t opts_parse(int argc, char **argv)
 		case 'A':
 		case 'w':
 		case 'H':
-		case 'L':
+		case 'x':
 		case 'B':
+		case 'j':
 		case 'R':
 			if (pv_getnum_check(optarg, PV_NUMTYPE_INTEGER) !=
 			    0) {
@@ -167,6 +186,56 @@ opts_t opts_parse(int argc, char **argv)
 				return 0;
 			}
 			break;
+		case 'G':
+			check_weight = strrchr(optarg, ':');
+			if ((optarg == check_weight) || (0 == optarg[0])) {
+				fprintf(stderr, "%s: -%c: %s\n",
+					opts->program_name, c,
+					_("rate group name expected"));
+				opts_free(opts);
+				return 0;
+			}
+			if ((NULL != check_weight)
+			    && ((pv_getnum_check
+				 (check_weight + 1, PV_NUMTYPE_INTEGER) != 0)
+				|| (pv_getnum_i(check_weight + 1) < 1))) {
+				fprintf(stderr, "%s: -%c: %s\n",
+					opts->program_name, c,
+					_("positive integer weight expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
+		case 'L':
+			if (NULL == strchr(optarg, '=')) {
+				if (pv_getnum_check(optarg, PV_NUMTYPE_INTEGER)
+				    != 0) {
+					fprintf(stderr, "%s: -%c: %s\n",
+						opts->program_name, c,
+						_
+						("integer argument expected"));
+					opts_free(opts);
+					return 0;
+				}
+			} else if (pv_getnum_schedule(optarg, NULL, 0) < 1) {
+				fprintf(stderr, "%s: -%c: %s\n",
+					opts->program_name, c,
+					_("invalid rate limit schedule"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
+		case 'z':
+			if ((NULL != strchr(optarg, ':')) ?
+			    (pv_getnum_clock(optarg) < 0) :
+			    (pv_getnum_duration(optarg) <= 0)) {
+				fprintf(stderr, "%s: -%c: %s\n",
+					opts->program_name, c,
+					_("time of day or duration expected"));
+				opts_free(opts);
+				return 0;
+			}
+			break;
 		case 'd':
 			if (sscanf(optarg, "%u:%d", &check_pid, &check_fd)
 			    < 1) {
@@ -269,6 +338,9 @@ opts_t opts_parse(int argc, char **argv)
 			opts->null = 1;
 			opts->linemode = 1;
 			break;
+		case 'k':
+			opts->line_cache = 1;
+			break;
 		case 'i':
 			opts->interval = pv_getnum_d(optarg);
 			break;
@@ -282,14 +354,95 @@ opts_t opts_parse(int argc, char **argv)
 			opts->name = optarg;
 			break;
 		case 'L':
-			opts->rate_limit = pv_getnum_ll(optarg);
+			opts->rate_limit = 0;
+			opts->rate_schedule = NULL;
+			if (NULL != strchr(optarg, '=')) {
+				opts->rate_schedule = optarg;
+			} else {
+				opts->rate_limit = pv_getnum_ll(optarg);
+			}
+			break;
+		case 'x':
+			opts->rate_burst = pv_getnum_ll(optarg);
+			break;
+		case 'G':
+			opts->rate_group = optarg;
+			opts->rate_group_weight = 1;
+			check_weight = strrchr(optarg, ':');
+			if (NULL != check_weight) {
+				*check_weight = 0;
+				opts->rate_group_weight =
+				    pv_getnum_i(check_weight + 1);
+			}
+			break;
+		case 'z':
+			/*
+			 * A time of day is the next time it comes round, so
+			 * the deadline is always within the next 24 hours.
+			 */
+			check_clock = -1;
+			if (NULL != strchr(optarg, ':'))
+				check_clock = pv_getnum_clock(optarg);
+			if (check_clock >= 0) {
+				struct tm *tm;
+				time_t now, when;
+
+				now = time(NULL);
+				tm = localtime(&now);
+				tm->tm_hour = check_clock / 3600;
+				tm->tm_min = (check_clock / 60) % 60;
+				tm->tm_sec = check_clock % 60;
+				tm->tm_isdst = -1;
+				when = mktime(tm);
+				if (when <= now) {
+					tm->tm_mday++;
+					tm->tm_isdst = -1;
+					when = mktime(tm);
+				}
+				opts->deadline = difftime(when, now);
+			} else {
+				opts->deadline = pv_getnum_duration(optarg);
+			}
 			break;
 		case 'B':
 			opts->buffer_size = pv_getnum_ll(optarg);
 			break;
+		case 'j':
+			opts->pipe_size = pv_getnum_ll(optarg);
+			break;
 		case 'C':
 			opts->no_splice = 1;
 			break;
+		case 'J':
+			opts->splice_pipe = 1;
+			break;
+		case 'K':
+			opts->direct_io = 1;
+			break;
+		case 'X':
+			opts->drop_cache = 1;
+			break;
+		case 'Y':
+			opts->write_behind = 1;
+			break;
+		case 'y':
+			opts->flush = 1;
+			break;
+		case 'Z':
+			opts->sparse = 1;
+			break;
+		case 'u':
+			opts->huge_pages = 1;
+			break;
+		case 'm':
+			opts->mlock = 1;
+			break;
+		case 'U':
+			opts->io_uring = 1;
+			break;
+		case 'M':
+			opts->threaded = 1;
+			break;
 		case 'E':
 			opts->skip_errors++;
 			break;
@@ -330,9 +483,16 @@ opts_t opts_parse(int argc, char **argv)
 	} while (c != -1);
 
 	if (0 != opts->watch_pid) {
-		if (opts->linemode || opts->null || opts->stop_at_size
+		if (opts->linemode || opts->null || opts->line_cache
+		    || opts->stop_at_size
 		    || (opts->skip_errors > 0) || (opts->buffer_size > 0)
-		    || (opts->rate_limit > 0)) {
+		    || (opts->pipe_size > 0)
+		    || opts->direct_io || opts->drop_cache
+		    || opts->write_behind || opts->flush || opts->sparse
+		    || opts->huge_pages || opts->mlock
+		    || (opts->rate_limit > 0) || (opts->rate_burst > 0)
+		    || (NULL != opts->rate_schedule)
+		    || (NULL != opts->rate_group) || (opts->deadline > 0)) {
 			fprintf(stderr,
 				_
 				("%s: cannot use line mode or transfer modifier options when watching file descriptors"),
@@ -383,6 +543,21 @@ opts_t opts_parse(int argc, char **argv)
 		}
 	}
 
+	if ((0 != opts->remote) && (NULL != opts->rate_schedule)) {
+		fprintf(stderr, "%s: -L: %s\n", opts->program_name,
+			_("cannot send a rate limit schedule with -R"));
+		opts_free(opts);
+		return 0;
+	}
+
+	if ((NULL != opts->rate_group) && (0 == opts->rate_limit)
+	    && (NULL == opts->rate_schedule)) {
+		fprintf(stderr, "%s: -G: %s\n", opts->program_name,
+			_("a rate limit (-L) is needed for a rate group"));
+		opts_free(opts);
+		return 0;
+	}
+
 	/*
 	 * Default options: -pterb
 	 */
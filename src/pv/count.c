@@ -0,0 +1,382 @@
+/*
+ * Functions for counting line terminators in a buffer, for finding where
+ * a given number of lines ends, and for checking whether a buffer is all
+ * zero bytes.
+ *
+ * In line mode, every byte that passes through is checked, so this needs
+ * to keep up with the transfer itself; the same goes for looking for zero
+ * blocks when writing sparse output.  On x86 processors, this is done with
+ * the widest vector instructions the processor supports, which is worked
+ * out on the first call; elsewhere, memchr() and memcmp() are used, which
+ * the C library will usually have optimised already.
+ */
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define PV_COUNT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(PV_COUNT_X86) && (defined(__clang__) || (__GNUC__ >= 6))
+#define PV_COUNT_AVX512 1
+#endif
+
+
+/*
+ * Return the number of times "c" appears in the "length" bytes at "buf",
+ * using memchr().
+ */
+static unsigned long pv__count_scalar(const unsigned char *buf,
+				      size_t length, unsigned char c)
+{
+	const unsigned char *end;
+	unsigned long count;
+
+	count = 0;
+	end = buf + length;
+
+	while ((buf < end)
+	       && (NULL != (buf = memchr(buf, c, end - buf)))) {
+		count++;
+		buf++;
+	}
+
+	return count;
+}
+
+
+#ifdef PV_COUNT_X86
+/*
+ * Return the number of times "c" appears in the "length" bytes at "buf",
+ * 16 bytes at a time using SSE2.
+ *
+ * Each comparison gives 0xFF (-1) for a match, which is subtracted from a
+ * vector of per-byte counters; the counters are added up with PSADBW before
+ * any of them can overflow, which is after 255 rounds.
+ */
+__attribute__ ((target("sse2")))
+static unsigned long pv__count_sse2(const unsigned char *buf,
+				    size_t length, unsigned char c)
+{
+	__m128i needle, total;
+	unsigned long long sums[2];
+	unsigned long count;
+
+	needle = _mm_set1_epi8((char) c);
+	total = _mm_setzero_si128();
+
+	while (length >= 16) {
+		__m128i counters;
+		size_t rounds;
+
+		counters = _mm_setzero_si128();
+		for (rounds = 0; (rounds < 255) && (length >= 16); rounds++) {
+			__m128i data;
+			data = _mm_loadu_si128((const __m128i *) buf);
+			counters =
+			    _mm_sub_epi8(counters,
+					 _mm_cmpeq_epi8(data, needle));
+			buf += 16;
+			length -= 16;
+		}
+		total =
+		    _mm_add_epi64(total,
+				  _mm_sad_epu8(counters,
+					       _mm_setzero_si128()));
+	}
+
+	_mm_storeu_si128((__m128i *) sums, total);
+	count = sums[0] + sums[1];
+
+	return count + pv__count_scalar(buf, length, c);
+}
+
+
+/*
+ * As above, but 32 bytes at a time using AVX2.
+ */
+__attribute__ ((target("avx2")))
+static unsigned long pv__count_avx2(const unsigned char *buf,
+				    size_t length, unsigned char c)
+{
+	__m256i needle, total;
+	unsigned long long sums[4];
+	unsigned long count;
+
+	needle = _mm256_set1_epi8((char) c);
+	total = _mm256_setzero_si256();
+
+	while (length >= 32) {
+		__m256i counters;
+		size_t rounds;
+
+		counters = _mm256_setzero_si256();
+		for (rounds = 0; (rounds < 255) && (length >= 32); rounds++) {
+			__m256i data;
+			data = _mm256_loadu_si256((const __m256i *) buf);
+			counters =
+			    _mm256_sub_epi8(counters,
+					    _mm256_cmpeq_epi8(data,
+							      needle));
+			buf += 32;
+			length -= 32;
+		}
+		total =
+		    _mm256_add_epi64(total,
+				     _mm256_sad_epu8(counters,
+						     _mm256_setzero_si256()));
+	}
+
+	_mm256_storeu_si256((__m256i *) sums, total);
+	count = sums[0] + sums[1] + sums[2] + sums[3];
+
+	return count + pv__count_sse2(buf, length, c);
+}
+
+
+#ifdef PV_COUNT_AVX512
+/*
+ * As above, but 64 bytes at a time using AVX-512BW, where comparisons give
+ * a bit mask which can be counted directly.
+ */
+__attribute__ ((target("avx512f,avx512bw,popcnt")))
+static unsigned long pv__count_avx512(const unsigned char *buf,
+				      size_t length, unsigned char c)
+{
+	__m512i needle;
+	unsigned long count;
+
+	needle = _mm512_set1_epi8((char) c);
+	count = 0;
+
+	while (length >= 64) {
+		__m512i data;
+		data = _mm512_loadu_si512((const void *) buf);
+		count +=
+		    __builtin_popcountll(_mm512_cmpeq_epi8_mask
+					 (data, needle));
+		buf += 64;
+		length -= 64;
+	}
+
+	return count + pv__count_avx2(buf, length, c);
+}
+#endif				/* PV_COUNT_AVX512 */
+#endif				/* PV_COUNT_X86 */
+
+
+static unsigned long pv__count_select(const unsigned char *, size_t,
+				      unsigned char);
+
+/*
+ * The counting function to use, which starts off as pv__count_select() so
+ * that the best one is chosen on the first call.
+ */
+static unsigned long (*pv__count_function) (const unsigned char *, size_t,
+					    unsigned char) =
+    pv__count_select;
+
+
+/*
+ * Choose the best counting function for this processor, and then use it.
+ */
+static unsigned long pv__count_select(const unsigned char *buf,
+				      size_t length, unsigned char c)
+{
+	unsigned long (*chosen) (const unsigned char *, size_t,
+				 unsigned char);
+
+	chosen = pv__count_scalar;
+
+#ifdef PV_COUNT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		chosen = pv__count_sse2;
+	if (__builtin_cpu_supports("avx2"))
+		chosen = pv__count_avx2;
+#ifdef PV_COUNT_AVX512
+	if (__builtin_cpu_supports("avx512bw")
+	    && __builtin_cpu_supports("popcnt"))
+		chosen = pv__count_avx512;
+#endif				/* PV_COUNT_AVX512 */
+#endif				/* PV_COUNT_X86 */
+
+	__atomic_store_n(&pv__count_function, chosen, __ATOMIC_RELAXED);
+
+	return chosen(buf, length, c);
+}
+
+
+/*
+ * Return nonzero if all "length" bytes at "buf" are zero, by comparing the
+ * buffer with itself one byte along.
+ */
+static int pv__zero_scalar(const unsigned char *buf, size_t length)
+{
+	if (0 == length)
+		return 1;
+	if (0 != buf[0])
+		return 0;
+	return (0 == memcmp(buf, buf + 1, length - 1)) ? 1 : 0;
+}
+
+
+#ifdef PV_COUNT_X86
+/*
+ * Return nonzero if all "length" bytes at "buf" are zero, 64 bytes at a
+ * time using SSE2, stopping as soon as a non-zero byte is seen.
+ */
+__attribute__ ((target("sse2")))
+static int pv__zero_sse2(const unsigned char *buf, size_t length)
+{
+	while (length >= 64) {
+		__m128i a, b, c, d;
+		a = _mm_loadu_si128((const __m128i *) buf);
+		b = _mm_loadu_si128((const __m128i *) (buf + 16));
+		c = _mm_loadu_si128((const __m128i *) (buf + 32));
+		d = _mm_loadu_si128((const __m128i *) (buf + 48));
+		a = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (0xFFFF !=
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())))
+			return 0;
+		buf += 64;
+		length -= 64;
+	}
+
+	return pv__zero_scalar(buf, length);
+}
+
+
+/*
+ * As above, but 128 bytes at a time using AVX2.
+ */
+__attribute__ ((target("avx2")))
+static int pv__zero_avx2(const unsigned char *buf, size_t length)
+{
+	while (length >= 128) {
+		__m256i a, b, c, d;
+		a = _mm256_loadu_si256((const __m256i *) buf);
+		b = _mm256_loadu_si256((const __m256i *) (buf + 32));
+		c = _mm256_loadu_si256((const __m256i *) (buf + 64));
+		d = _mm256_loadu_si256((const __m256i *) (buf + 96));
+		a = _mm256_or_si256(_mm256_or_si256(a, b),
+				    _mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(a, a))
+			return 0;
+		buf += 128;
+		length -= 128;
+	}
+
+	return pv__zero_sse2(buf, length);
+}
+#endif				/* PV_COUNT_X86 */
+
+
+static int pv__zero_select(const unsigned char *, size_t);
+
+/*
+ * The zero checking function to use, chosen on the first call in the same
+ * way as pv__count_function.
+ */
+static int (*pv__zero_function) (const unsigned char *, size_t) =
+    pv__zero_select;
+
+
+/*
+ * Choose the best zero checking function for this processor, and then use
+ * it.
+ */
+static int pv__zero_select(const unsigned char *buf, size_t length)
+{
+	int (*chosen) (const unsigned char *, size_t);
+
+	chosen = pv__zero_scalar;
+
+#ifdef PV_COUNT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		chosen = pv__zero_sse2;
+	if (__builtin_cpu_supports("avx2"))
+		chosen = pv__zero_avx2;
+#endif				/* PV_COUNT_X86 */
+
+	__atomic_store_n(&pv__zero_function, chosen, __ATOMIC_RELAXED);
+
+	return chosen(buf, length);
+}
+
+
+/*
+ * Return the number of times the byte "c" appears in the "length" bytes
+ * at "buf".
+ */
+unsigned long pv_count_byte(const unsigned char *buf, size_t length,
+			    unsigned char c)
+{
+	unsigned long (*function) (const unsigned char *, size_t,
+				   unsigned char);
+
+	function = __atomic_load_n(&pv__count_function, __ATOMIC_RELAXED);
+
+	return function(buf, length, c);
+}
+
+
+/*
+ * Return the length of the start of the "length" bytes at "buf" which
+ * holds no more than *records whole records ending in "c", and subtract
+ * the number of records it holds from *records.  If there are fewer than
+ * *records terminators, the whole length is returned, so that a buffer
+ * which wraps around can be handled in two calls.
+ *
+ * The terminators are counted first, so that in the usual case, where
+ * everything is allowed through, the whole buffer is dealt with at the
+ * speed of pv_count_byte(); only when the records must be cut short is
+ * the buffer walked one record at a time.
+ */
+size_t pv_count_records(const unsigned char *buf, size_t length,
+			unsigned char c, unsigned long long *records)
+{
+	const unsigned char *ptr, *end;
+	unsigned long count;
+
+	if (0 == *records)
+		return 0;
+
+	count = pv_count_byte(buf, length, c);
+	if (count <= *records) {
+		*records -= count;
+		return length;
+	}
+
+	ptr = buf;
+	end = buf + length;
+	while ((*records > 0)
+	       && (NULL != (ptr = memchr(ptr, c, end - ptr)))) {
+		ptr++;
+		(*records)--;
+	}
+
+	return ptr - buf;
+}
+
+
+/*
+ * Return nonzero if all of the "length" bytes at "buf" are zero.
+ */
+int pv_zero_block(const unsigned char *buf, size_t length)
+{
+	int (*function) (const unsigned char *, size_t);
+
+	function = __atomic_load_n(&pv__zero_function, __ATOMIC_RELAXED);
+
+	return function(buf, length);
+}
+
+/* EOF */
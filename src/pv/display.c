@@ -544,25 +544,35 @@ static char *pv__format(pvstate_t state,
 	 * With --timer we prefix the output with the elapsed time.
 	 * With --bytes we output the bytes transferred so far instead
 	 * of the percentage. (Or lines, if --lines was given with --bytes).
+	 * With --rate we follow that with the current rate, per second (of
+	 * lines, in line mode).
 	 */
 	if (state->numeric) {
 		char numericprefix[128];
+		char numericsuffix[128];
 
 		numericprefix[0] = 0;
+		numericsuffix[0] = 0;
 
 		if ((state->components_used & PV_DISPLAY_TIMER) != 0)
 			sprintf(numericprefix, "%.4Lf ", elapsed_sec);
 
+		if ((state->components_used & PV_DISPLAY_RATE) != 0)
+			snprintf(numericsuffix, sizeof(numericsuffix),
+				 " %.4Lf", rate);
+
 		if ((state->components_used & PV_DISPLAY_BYTES) != 0) {
-			sprintf(state->display_buffer, "%.99s%lld\n",
-				numericprefix, total_bytes);
+			sprintf(state->display_buffer, "%.99s%lld%.99s\n",
+				numericprefix, total_bytes, numericsuffix);
 		} else if (state->percentage > 100) {
 			/* As mentioned above, we go 0-100, then 100-0. */
-			sprintf(state->display_buffer, "%.99s%ld\n",
-				numericprefix, 200 - state->percentage);
+			sprintf(state->display_buffer, "%.99s%ld%.99s\n",
+				numericprefix, 200 - state->percentage,
+				numericsuffix);
 		} else {
-			sprintf(state->display_buffer, "%.99s%ld\n",
-				numericprefix, state->percentage);
+			sprintf(state->display_buffer, "%.99s%ld%.99s\n",
+				numericprefix, state->percentage,
+				numericsuffix);
 		}
 
 		return state->display_buffer;
@@ -12,6 +12,510 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#if defined(HAVE_SYS_XATTR_H) && defined(__linux__)
+#define PV_LINE_CACHE 1
+#include <sys/xattr.h>
+#endif
+
+/*
+ * Extended attributes that --line-cache stores line counts in, for newline
+ * and null terminated lines.
+ */
+#define LINECOUNT_XATTR		"user.pv.lines"
+#define LINECOUNT_XATTR_NULL	"user.pv.lines0"
+
+
+/*
+ * An input file whose lines are to be counted.
+ */
+struct pvlinecount_file_s {
+	const char *filename;		 /* file to read, "-" for stdin */
+	struct stat64 sb;		 /* file status before counting */
+	unsigned long long lines;	 /* number of lines in the file */
+	int error;			 /* errno if reading it failed */
+	int cached;			 /* set if "lines" came from the cache */
+};
+
+/*
+ * A piece of an input file whose lines are to be counted.
+ */
+struct pvlinecount_chunk_s {
+	struct pvlinecount_file_s *file; /* file the chunk is part of */
+	unsigned long long offset;	 /* where in the file to start */
+	unsigned long long length;	 /* number of bytes to count */
+	unsigned long long lines;	 /* number of lines in the chunk */
+	int error;			 /* errno if reading it failed */
+};
+
+/*
+ * State shared by the threads counting lines in the input files.
+ *
+ * When the count is done in the background, state->linecount points to
+ * this until the main loop picks up the total; "done" is set, with release
+ * semantics, once "total" is final, so that the main loop only has to read
+ * the flag to know whether the total has arrived.
+ */
+struct pvlinecount_s {
+	pvstate_t state;
+	struct pvlinecount_file_s *files;
+	int file_count;
+	struct pvlinecount_chunk_s *chunks;
+	int chunk_count;
+	int next_chunk;			 /* next chunk to be claimed */
+	int abort;			 /* set to make the workers give up */
+	unsigned long long total;	 /* total lines counted */
+#ifdef HAVE_LIBPTHREAD
+	pthread_t thread;		 /* thread running the whole count */
+	int done;			 /* set when "total" is final */
+#endif
+};
+
+
+#ifdef PV_LINE_CACHE
+/*
+ * Write the cache key for the given file status, and the given line count,
+ * into "buf" (max length "bufsize"), returning the length of the key and
+ * count together.  The count is only valid while the inode, size, and
+ * modification time are unchanged.
+ */
+static int pv__linecount_cache_value(char *buf, size_t bufsize,
+				     struct stat64 *sb,
+				     unsigned long long lines)
+{
+	return snprintf(buf, bufsize, "%llu:%llu:%lld.%09ld:%llu",
+			(unsigned long long) (sb->st_ino),
+			(unsigned long long) (sb->st_size),
+			(long long) (sb->st_mtim.tv_sec),
+			(long) (sb->st_mtim.tv_nsec), lines);
+}
+
+
+/*
+ * Look up the line count of the given file in its extended attributes,
+ * setting file->lines and file->cached if there is a valid one.
+ */
+static void pv__linecount_cache_get(pvstate_t state,
+				    struct pvlinecount_file_s *file)
+{
+	char value[256];
+	char expected[256];
+	const char *name;
+	unsigned long long lines;
+	ssize_t length;
+	char *colon;
+
+	name = state->null ? LINECOUNT_XATTR_NULL : LINECOUNT_XATTR;
+
+	if (0 == strcmp(file->filename, "-")) {
+		length =
+		    fgetxattr(STDIN_FILENO, name, value, sizeof(value) - 1);
+	} else {
+		length =
+		    getxattr(file->filename, name, value,
+			     sizeof(value) - 1);
+	}
+	if (length <= 0)
+		return;
+	value[length] = 0;
+
+	/*
+	 * The line count is after the last colon; everything before it
+	 * must match the file as it is now.
+	 */
+	colon = strrchr(value, ':');
+	if (NULL == colon)
+		return;
+	lines = strtoull(colon + 1, NULL, 10);
+
+	pv__linecount_cache_value(expected, sizeof(expected), &(file->sb),
+				  lines);
+	if (0 != strcmp(value, expected))
+		return;
+
+	debug("%s: %s: %llu", file->filename, "cached line count", lines);
+
+	file->lines = lines;
+	file->cached = 1;
+}
+
+
+/*
+ * Store the line count of the given file in its extended attributes, as
+ * long as it has not changed since it was counted.  Failures are ignored,
+ * since not all filesystems or files allow this.
+ */
+static void pv__linecount_cache_put(pvstate_t state,
+				    struct pvlinecount_file_s *file)
+{
+	struct stat64 sb;
+	char value[256];
+	const char *name;
+	int rc, length;
+
+	if (0 == strcmp(file->filename, "-")) {
+		rc = fstat64(STDIN_FILENO, &sb);
+	} else {
+		rc = stat64(file->filename, &sb);
+	}
+	if ((rc != 0)
+	    || (sb.st_ino != file->sb.st_ino)
+	    || (sb.st_size != file->sb.st_size)
+	    || (sb.st_mtim.tv_sec != file->sb.st_mtim.tv_sec)
+	    || (sb.st_mtim.tv_nsec != file->sb.st_mtim.tv_nsec))
+		return;
+
+	name = state->null ? LINECOUNT_XATTR_NULL : LINECOUNT_XATTR;
+	length =
+	    pv__linecount_cache_value(value, sizeof(value), &sb,
+				      file->lines);
+
+	if (0 == strcmp(file->filename, "-")) {
+		rc = fsetxattr(STDIN_FILENO, name, value, length, 0);
+	} else {
+		rc = setxattr(file->filename, name, value, length, 0);
+	}
+	if (rc != 0) {
+		debug("%s: %s: %s", file->filename,
+		      "failed to cache line count", strerror(errno));
+	}
+}
+#endif				/* PV_LINE_CACHE */
+
+
+/*
+ * Count the line terminators in the given chunk of an input file, reading
+ * it into "buf" in pieces of "bufsize" bytes, and return the count.  On
+ * error, chunk->error is set.
+ */
+static unsigned long long pv__linecount_chunk(struct pvlinecount_s
+					      *info,
+					      struct pvlinecount_chunk_s
+					      *chunk, unsigned char *buf,
+					      size_t bufsize)
+{
+	unsigned long long offset, remaining, count;
+	int fd;
+
+	if (0 == strcmp(chunk->file->filename, "-")) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open64(chunk->file->filename, O_RDONLY);
+		if (fd < 0) {
+			chunk->error = errno;
+			return 0;
+		}
+	}
+
+	count = 0;
+	offset = chunk->offset;
+	remaining = chunk->length;
+
+	while ((remaining > 0)
+	       && (0 == __atomic_load_n(&(info->abort), __ATOMIC_RELAXED))) {
+		ssize_t numread;
+
+		numread =
+		    pread64(fd, buf,
+			    remaining > bufsize ? bufsize : remaining,
+			    offset);
+		if (numread < 0) {
+			if (EINTR == errno)
+				continue;
+			chunk->error = errno;
+			break;
+		} else if (0 == numread) {
+			break;
+		}
+
+		count +=
+		    pv_count_byte(buf, numread,
+				  info->state->null ? 0 : '\n');
+		offset += numread;
+		remaining -= numread;
+	}
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return count;
+}
+
+
+/*
+ * Line counting worker: claim chunks one at a time until there are none
+ * left, and count the lines in each one.
+ */
+static void *pv__linecount_worker(void *arg)
+{
+	struct pvlinecount_s *info = arg;
+	struct pvlinecount_chunk_s *chunk;
+	unsigned char *buf;
+	int idx;
+
+	buf = malloc(LINECOUNT_READ_SIZE);
+	if (NULL == buf)
+		return NULL;
+
+	while (1) {
+		idx =
+		    __atomic_fetch_add(&(info->next_chunk), 1,
+				       __ATOMIC_RELAXED);
+		if (idx >= info->chunk_count)
+			break;
+		if (__atomic_load_n(&(info->abort), __ATOMIC_RELAXED))
+			break;
+		chunk = &(info->chunks[idx]);
+		chunk->lines =
+		    pv__linecount_chunk(info, chunk, buf,
+					LINECOUNT_READ_SIZE);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+
+/*
+ * Run the line count described by "info", in one thread per processor
+ * (including this one), returning when all of the chunks are done and
+ * info->total has been filled in.
+ */
+static void pv__linecount_run(struct pvlinecount_s *info)
+{
+	int threads, idx;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t workers[LINECOUNT_MAX_THREADS];
+	int started, i;
+#endif
+
+	threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (threads > info->chunk_count)
+		threads = info->chunk_count;
+	if (threads > LINECOUNT_MAX_THREADS)
+		threads = LINECOUNT_MAX_THREADS;
+	if (threads < 1)
+		threads = 1;
+
+#ifdef HAVE_LIBPTHREAD
+	/*
+	 * Start the extra workers; this thread acts as one as well.
+	 */
+	started = 0;
+	while (started < threads - 1) {
+		if (pthread_create
+		    (&(workers[started]), NULL, pv__linecount_worker,
+		     info) != 0)
+			break;
+		started++;
+	}
+	debug("%s: %d", "line counting threads", started + 1);
+#endif
+
+	pv__linecount_worker(info);
+
+#ifdef HAVE_LIBPTHREAD
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+#endif
+
+	/*
+	 * Add up the chunks of each file, then all of the files.
+	 */
+	for (idx = 0; idx < info->chunk_count; idx++) {
+		struct pvlinecount_chunk_s *chunk = &(info->chunks[idx]);
+		chunk->file->lines += chunk->lines;
+		if ((0 != chunk->error) && (0 == chunk->file->error))
+			chunk->file->error = chunk->error;
+	}
+
+	info->total = 0;
+	for (idx = 0; idx < info->file_count; idx++)
+		info->total += info->files[idx].lines;
+
+#ifdef PV_LINE_CACHE
+	/*
+	 * Remember the line counts of any files we had to read, unless we
+	 * gave up on the count part way through.
+	 */
+	if ((info->state->line_cache)
+	    && (0 == __atomic_load_n(&(info->abort), __ATOMIC_RELAXED))) {
+		for (idx = 0; idx < info->file_count; idx++) {
+			struct pvlinecount_file_s *file =
+			    &(info->files[idx]);
+			if ((0 == file->cached) && (0 == file->error))
+				pv__linecount_cache_put(info->state, file);
+		}
+	}
+#endif				/* PV_LINE_CACHE */
+}
+
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Background thread: run the whole line count, and flag when it is done.
+ */
+static void *pv__linecount_background(void *arg)
+{
+	struct pvlinecount_s *info = arg;
+
+	pv__linecount_run(info);
+
+	__atomic_store_n(&(info->done), 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+#endif
+
+
+/*
+ * Free the line count described by "info".
+ */
+static void pv__linecount_free(struct pvlinecount_s *info)
+{
+	if (NULL != info->chunks)
+		free(info->chunks);
+	if (NULL != info->files)
+		free(info->files);
+	free(info);
+}
+
+
+/*
+ * Report any errors from the line count described by "info", then free it
+ * and return the total line count.
+ */
+static unsigned long long pv__linecount_finish(struct pvlinecount_s *info)
+{
+	pvstate_t state = info->state;
+	unsigned long long total;
+	int i;
+
+	for (i = 0; i < info->file_count; i++) {
+		if (0 == info->files[i].error)
+			continue;
+		pv_error(state, "%s: %s", info->files[i].filename,
+			 strerror(info->files[i].error));
+		state->exit_status |= 2;
+	}
+
+	total = info->total;
+
+	pv__linecount_free(info);
+
+	return total;
+}
+
+
+/*
+ * Count the lines in the "count" files named in "files", which must all be
+ * regular files, whose status is in "sbs".
+ *
+ * With --line-cache, files whose line count was stored by a previous run
+ * and which have not changed since are not read again.  The rest are split
+ * into chunks of up to LINECOUNT_CHUNK_SIZE bytes, which are shared out
+ * between one thread per processor, so that large files are counted in
+ * parallel as well as many small ones.
+ *
+ * If threads are available, the count is started in the background and 0
+ * is returned, with state->linecount pointing to the count in progress so
+ * that pv_calc_total_size_check() can pick up the total later.  Otherwise
+ * the total is returned directly.
+ */
+static unsigned long long pv__linecount(pvstate_t state, int count,
+					const char **files,
+					struct stat64 *sbs)
+{
+	struct pvlinecount_s *info;
+	unsigned long long offset, size;
+	int chunk_count, i;
+
+	info = calloc(1, sizeof(*info));
+	if (NULL != info)
+		info->files = calloc(count, sizeof(*(info->files)));
+	if ((NULL == info) || (NULL == info->files)) {
+		pv_error(state, "%s: %s", _("buffer allocation failed"),
+			 strerror(errno));
+		state->exit_status |= 64;
+		if (NULL != info)
+			free(info);
+		return 0;
+	}
+
+	info->state = state;
+	info->file_count = count;
+
+	chunk_count = 0;
+	for (i = 0; i < count; i++) {
+		struct pvlinecount_file_s *file = &(info->files[i]);
+		file->filename = files[i];
+		file->sb = sbs[i];
+#ifdef PV_LINE_CACHE
+		if (state->line_cache)
+			pv__linecount_cache_get(state, file);
+#endif
+		if (file->cached)
+			continue;
+		size = file->sb.st_size;
+		chunk_count +=
+		    (size + LINECOUNT_CHUNK_SIZE - 1) / LINECOUNT_CHUNK_SIZE;
+	}
+
+	/*
+	 * If there is nothing to read, the total is already known.
+	 */
+	if (0 == chunk_count) {
+		for (i = 0; i < count; i++)
+			info->total += info->files[i].lines;
+		return pv__linecount_finish(info);
+	}
+
+	info->chunks = calloc(chunk_count, sizeof(*(info->chunks)));
+	if (NULL == info->chunks) {
+		pv_error(state, "%s: %s", _("buffer allocation failed"),
+			 strerror(errno));
+		state->exit_status |= 64;
+		pv__linecount_free(info);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct pvlinecount_file_s *file = &(info->files[i]);
+		if (file->cached)
+			continue;
+		size = file->sb.st_size;
+		for (offset = 0; offset < size;
+		     offset += LINECOUNT_CHUNK_SIZE) {
+			struct pvlinecount_chunk_s *chunk;
+			chunk = &(info->chunks[info->chunk_count++]);
+			chunk->file = file;
+			chunk->offset = offset;
+			chunk->length = size - offset;
+			if (chunk->length > LINECOUNT_CHUNK_SIZE)
+				chunk->length = LINECOUNT_CHUNK_SIZE;
+		}
+	}
+
+#ifdef HAVE_LIBPTHREAD
+	if (0 ==
+	    pthread_create(&(info->thread), NULL, pv__linecount_background,
+			   info)) {
+		debug("%s", "line count started in background");
+		state->linecount = info;
+		return 0;
+	}
+#endif
+
+	pv__linecount_run(info);
+
+	return pv__linecount_finish(info);
+}
 
 
 /*
@@ -24,26 +528,38 @@
  *
  * In line mode, any files that pass the above checks will then be read to
  * determine how many lines they contain, and the total size will be set to
- * the total line count. Only regular files will be read.
+ * the total line count. Only regular files will be read, and if any input
+ * is not a regular file, the total size is unknown.
+ *
+ * Counting lines can take a long time, so where possible it is done in the
+ * background while the transfer runs, and the total is filled in later by
+ * pv_calc_total_size_check(); pv_calc_total_size_pending() says whether
+ * this is happening.
  *
- * Returns the total size, or 0 if it is unknown.
+ * Returns the total size, or 0 if it is unknown (or not yet known).
  */
 unsigned long long pv_calc_total_size(pvstate_t state)
 {
 	unsigned long long total;
-	struct stat64 sb;
+	struct stat64 sb, *sbs;
+	const char *stdin_name;
 	int rc, i, j, fd;
 
 	total = 0;
 	rc = 0;
 
 	/*
-	 * No files specified - check stdin.
+	 * No files specified - check stdin, counting its lines in line mode.
 	 */
 	if (state->input_file_count < 1) {
-		if (0 == fstat64(STDIN_FILENO, &sb))
-			total = sb.st_size;
-		return total;
+		if (0 != fstat64(STDIN_FILENO, &sb))
+			return 0;
+		if (!state->linemode)
+			return sb.st_size;
+		if (!S_ISREG(sb.st_mode))
+			return 0;
+		stdin_name = "-";
+		return pv__linecount(state, 1, &stdin_name, &sb);
 	}
 
 	for (i = 0; i < state->input_file_count; i++) {
@@ -99,6 +615,13 @@ unsigned long long pv_calc_total_size(pvstate_t state)
 		}
 	}
 
+	/*
+	 * If the input files add up to a known size, the output can be
+	 * preallocated to fit (see pv_transfer_preallocate()).
+	 */
+	if (total > 0)
+		state->prealloc_size = total;
+
 	/*
 	 * Patch from Peter Samuelson: if we cannot work out the size of the
 	 * input, but we are writing to a block device, then use the size of
@@ -135,60 +658,30 @@ unsigned long long pv_calc_total_size(pvstate_t state)
 		return total;
 
 	/*
-	 * In line mode, we count input lines to work out the total size.
+	 * In line mode, we count input lines to work out the total size,
+	 * as long as all of the input files are regular files.
 	 */
-	total = 0;
+	sbs = calloc(state->input_file_count + 1, sizeof(*sbs));
+	if (NULL == sbs)
+		return 0;
 
 	for (i = 0; i < state->input_file_count; i++) {
-		fd = -1;
-
 		if (0 == strcmp(state->input_files[i], "-")) {
-			rc = fstat64(STDIN_FILENO, &sb);
-			if ((rc != 0) || (!S_ISREG(sb.st_mode))) {
-				total = 0;
-				return total;
-			}
-			fd = dup(STDIN_FILENO);
+			rc = fstat64(STDIN_FILENO, &(sbs[i]));
 		} else {
-			rc = stat64(state->input_files[i], &sb);
-			if ((rc != 0) || (!S_ISREG(sb.st_mode))) {
-				total = 0;
-				return total;
-			}
-			fd = open64(state->input_files[i], O_RDONLY);
+			rc = stat64(state->input_files[i], &(sbs[i]));
 		}
-
-		if (fd < 0) {
-			pv_error(state, "%s: %s", state->input_files[i],
-				 strerror(errno));
-			total = 0;
-			state->exit_status |= 2;
-			return total;
+		if ((rc != 0) || (!S_ISREG(sbs[i].st_mode))) {
+			free(sbs);
+			return 0;
 		}
+	}
 
-		while (1) {
-			unsigned char scanbuf[1024];
-			int numread, j;
+	total =
+	    pv__linecount(state, state->input_file_count,
+			  state->input_files, sbs);
 
-			numread = read(fd, scanbuf, sizeof(scanbuf));
-			if (numread < 0) {
-				pv_error(state, "%s: %s",
-					 state->input_files[i],
-					 strerror(errno));
-				state->exit_status |= 2;
-				break;
-			} else if (0 == numread) {
-				break;
-			}
-			for (j = 0; j < numread; j++) {
-				if ('\n' == scanbuf[j])
-					total++;
-			}
-		}
-
-		lseek64(fd, 0, SEEK_SET);
-		close(fd);
-	}
+	free(sbs);
 
 	return total;
 }
@@ -208,6 +701,17 @@ int pv_next_file(pvstate_t state, int filenum, int oldfd)
 	struct stat64 osb;
 	int fd, input_file_is_stdout;
 
+	if ((oldfd >= 0) && (oldfd == state->advise_fd))
+		state->advise_fd = -1;
+	if ((oldfd >= 0) && (oldfd == state->sparse_input_fd))
+		state->sparse_input_fd = -1;
+
+	if ((oldfd >= 0) && (oldfd == state->direct_input_fd)) {
+		if (STDIN_FILENO == oldfd)
+			pv_transfer_direct_set(oldfd, 0);
+		state->direct_input_fd = -1;
+	}
+
 	if (oldfd > 0) {
 		if (close(oldfd)) {
 			pv_error(state, "%s: %s",
@@ -283,6 +787,70 @@ int pv_next_file(pvstate_t state, int filenum, int oldfd)
 		return -1;
 	}
 
+	/*
+	 * With --direct-io, read regular files and block devices with
+	 * O_DIRECT, if the filesystem or device allows it.
+	 */
+	if ((state->direct_io)
+	    && (S_ISREG(isb.st_mode) || S_ISBLK(isb.st_mode))
+	    && (0 == pv_transfer_direct_set(fd, 1))) {
+		state->direct_input_fd = fd;
+	}
+
+	/*
+	 * If the input is a pipe, make it bigger so that we can read more
+	 * of it at once.
+	 */
+	if (S_ISFIFO(isb.st_mode))
+		pv_transfer_pipe_resize(state, fd);
+
+#ifdef SEEK_DATA
+	/*
+	 * With --sparse, look for holes in regular input files, starting
+	 * from wherever the file position is now.
+	 */
+	if ((state->sparse) && (!state->linemode) && (!state->direct_io)
+	    && S_ISREG(isb.st_mode)) {
+		long long offset;
+
+		offset = lseek64(fd, 0, SEEK_CUR);
+		if (offset >= 0) {
+			state->sparse_input_fd = fd;
+			state->sparse_in_offset = offset;
+			state->sparse_next_hole = offset;
+		}
+	}
+#endif				/* SEEK_DATA */
+
+#ifdef HAVE_POSIX_FADVISE
+	/*
+	 * Tell the kernel that regular files will be read sequentially, as
+	 * cat(1) does, and start keeping track of where we are in the file
+	 * so that pv_file_advise() can read ahead of us.  There is no point
+	 * in this when the page cache is being bypassed.
+	 */
+	if (S_ISREG(isb.st_mode) && (state->direct_input_fd != fd)) {
+		long long offset;
+
+		offset = lseek64(fd, 0, SEEK_CUR);
+		if (offset < 0)
+			offset = 0;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		state->advise_fd = fd;
+		state->advise_offset = offset;
+		state->advise_ahead = offset;
+		state->advise_dropped = offset;
+		state->advise_size = isb.st_size;
+		state->advise_sample_offset = offset;
+		state->advise_rate = 0;
+		pv_monotonic_time(&(state->advise_sample_time));
+
+		pv_file_advise(state, fd, 0);
+	}
+#endif				/* HAVE_POSIX_FADVISE */
+
 	state->current_file = state->input_files[filenum];
 	if (0 == strcmp(state->input_files[filenum], "-")) {
 		state->current_file = "(stdin)";
@@ -290,4 +858,168 @@ int pv_next_file(pvstate_t state, int filenum, int oldfd)
 	return fd;
 }
 
+
+/*
+ * Record that "amount" more bytes have been read from the input file "fd",
+ * and give the kernel advice about it: ask for readahead of the next part
+ * of the file, sized to the rate at which we are reading it, and with
+ * --drop-cache, drop the part we have already read from the page cache.
+ *
+ * In threaded mode, this is called by the main thread on behalf of the
+ * reader thread, with whatever it has read since the last call.
+ */
+void pv_file_advise(pvstate_t state, int fd, unsigned long amount)
+{
+#ifdef HAVE_POSIX_FADVISE
+	struct timeval now;
+	long double elapsed;
+	unsigned long long window;
+
+	if ((fd < 0) || (fd != state->advise_fd))
+		return;
+
+	state->advise_offset += amount;
+
+	/*
+	 * Measure the rate the file is being read at, smoothing it out so
+	 * that one stall does not throw the readahead window off.
+	 */
+	pv_monotonic_time(&now);
+	elapsed = (now.tv_sec - state->advise_sample_time.tv_sec);
+	elapsed +=
+	    (now.tv_usec - state->advise_sample_time.tv_usec) / 1000000.0;
+	if (elapsed >= 0.25) {
+		long double rate;
+
+		rate = (state->advise_offset - state->advise_sample_offset)
+		    / elapsed;
+		if (state->advise_rate > 0) {
+			state->advise_rate =
+			    (3 * state->advise_rate + rate) / 4;
+		} else {
+			state->advise_rate = rate;
+		}
+		state->advise_sample_offset = state->advise_offset;
+		state->advise_sample_time = now;
+	}
+
+	window =
+	    (unsigned long long) (state->advise_rate * READAHEAD_USEC /
+				  1000000.0);
+	if (window < READAHEAD_MIN)
+		window = READAHEAD_MIN;
+	if (window > READAHEAD_MAX)
+		window = READAHEAD_MAX;
+
+	/*
+	 * Once we are more than half way through the readahead we last
+	 * asked for, ask for the next window's worth.
+	 */
+	if (state->advise_offset + window / 2 >= state->advise_ahead) {
+		unsigned long long start;
+
+		start = state->advise_ahead;
+		if (start < state->advise_offset)
+			start = state->advise_offset;
+		state->advise_ahead = state->advise_offset + window;
+
+		posix_fadvise(fd, (off_t) start,
+			      (off_t) (state->advise_ahead - start),
+			      POSIX_FADV_WILLNEED);
+	}
+
+	if (!state->drop_cache)
+		return;
+
+	/*
+	 * Drop what has been read in whole chunks, and all of it once we
+	 * reach the end of the file.  Each range starts a chunk before the
+	 * aligned end of the last one, since the kernel will not drop a
+	 * large folio that a range only partly covers, nor pages that are
+	 * still sitting in a pipe we spliced them into last time.
+	 */
+	if ((state->advise_offset - state->advise_dropped >= DROP_BEHIND_CHUNK)
+	    || (state->advise_offset >= state->advise_size)) {
+		unsigned long long start;
+
+		start = state->advise_dropped -
+		    (state->advise_dropped % DROP_BEHIND_CHUNK);
+		if (start >= DROP_BEHIND_CHUNK)
+			start -= DROP_BEHIND_CHUNK;
+
+		posix_fadvise(fd, (off_t) start,
+			      (off_t) (state->advise_offset - start),
+			      POSIX_FADV_DONTNEED);
+		state->advise_dropped = state->advise_offset;
+	}
+#endif				/* HAVE_POSIX_FADVISE */
+}
+
+/*
+ * Return nonzero if the total size is being calculated in the background,
+ * so that it may become known once the transfer has started.
+ */
+int pv_calc_total_size_pending(pvstate_t state)
+{
+	return (NULL != state->linecount) ? 1 : 0;
+}
+
+
+/*
+ * If the total size is being calculated in the background, and it has
+ * finished, fill in state->size, unless it has been set some other way in
+ * the meantime.  If "wait" is nonzero, wait for the calculation to finish
+ * first.
+ *
+ * This is called before each display update, and only has to check one
+ * flag until the background calculation completes.
+ */
+void pv_calc_total_size_check(pvstate_t state, int wait)
+{
+	struct pvlinecount_s *info;
+	unsigned long long total;
+
+	info = state->linecount;
+	if (NULL == info)
+		return;
+
+#ifdef HAVE_LIBPTHREAD
+	if ((0 == wait)
+	    && (0 == __atomic_load_n(&(info->done), __ATOMIC_ACQUIRE)))
+		return;
+
+	pthread_join(info->thread, NULL);
+#endif
+
+	state->linecount = NULL;
+
+	total = pv__linecount_finish(info);
+	debug("%s: %llu", "background size calculation finished", total);
+
+	if (0 == state->size)
+		state->size = total;
+}
+
+
+/*
+ * Abandon any background size calculation that is still running.
+ */
+void pv_calc_total_size_fini(pvstate_t state)
+{
+	struct pvlinecount_s *info;
+
+	info = state->linecount;
+	if (NULL == info)
+		return;
+
+	state->linecount = NULL;
+
+	__atomic_store_n(&(info->abort), 1, __ATOMIC_RELAXED);
+#ifdef HAVE_LIBPTHREAD
+	pthread_join(info->thread, NULL);
+#endif
+
+	pv__linecount_free(info);
+}
+
 /* EOF */
@@ -18,6 +18,30 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
+
+
+/*
+ * Fill in "tv" with the current time according to the monotonic clock,
+ * which - unlike the time of day - never jumps when the system clock is
+ * changed, so that elapsed times, rates, and ETAs are not thrown off.
+ * The time of day is used instead if there is no monotonic clock.
+ *
+ * All times that are compared with each other must come from here.
+ */
+void pv_monotonic_time(struct timeval *tv)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (0 == clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif				/* CLOCK_MONOTONIC */
+	gettimeofday(tv, NULL);
+}
 
 
 /*
@@ -47,10 +71,10 @@ static void pv_timeval_add_usec(struct timeval *val, long usec)
 int pv_main_loop(pvstate_t state)
 {
 	long written, lineswritten;
-	long long total_written, since_last, cansend;
-	long double target;
-	int eof_in, eof_out, final_update;
-	struct timeval start_time, next_update, next_ratecheck, cur_time;
+	long long total_written, since_last, cansend, display_shown;
+	unsigned long long bytes_written, flush_remaining;
+	int eof_in, eof_out, final_update, flushing;
+	struct timeval start_time, next_update, cur_time;
 	struct timeval init_time, next_remotecheck;
 	long double elapsed;
 	struct stat64 sb;
@@ -79,10 +103,15 @@ int pv_main_loop(pvstate_t state)
 	eof_out = 0;
 	total_written = 0;
 	since_last = 0;
+	display_shown = 0;
+	bytes_written = 0;
+	flush_remaining = 0;
+	flushing = 0;
 	state->initial_offset = 0;
 
-	gettimeofday(&start_time, NULL);
-	gettimeofday(&cur_time, NULL);
+	pv_monotonic_time(&start_time);
+	cur_time.tv_sec = start_time.tv_sec;
+	cur_time.tv_usec = start_time.tv_usec;
 
 	next_update.tv_sec = start_time.tv_sec;
 	next_update.tv_usec = start_time.tv_usec;
@@ -96,12 +125,9 @@ int pv_main_loop(pvstate_t state)
 				    (long) (1000000.0 * state->interval));
 	}
 
-	next_ratecheck.tv_sec = start_time.tv_sec;
-	next_ratecheck.tv_usec = start_time.tv_usec;
 	next_remotecheck.tv_sec = start_time.tv_sec;
 	next_remotecheck.tv_usec = start_time.tv_usec;
 
-	target = 0;
 	final_update = 0;
 	n = 0;
 
@@ -127,6 +153,25 @@ int pv_main_loop(pvstate_t state)
 	if (0 == state->target_buffer_size)
 		state->target_buffer_size = BUFFER_SIZE;
 
+	pv_transfer_pipe_resize(state, STDOUT_FILENO);
+	pv_transfer_direct_output(state);
+	pv_transfer_writebehind_init(state);
+	pv_transfer_sparse_init(state);
+
+	if (pv_transfer_preallocate(state)) {
+		if (state->cursor)
+			pv_crs_fini(state);
+		return state->exit_status;
+	}
+
+	/*
+	 * In threaded mode, the reader thread reads the input files from
+	 * here on, and pv_thread_transfer() moves on from one to the next.
+	 */
+	if ((state->threaded) && (!state->direct_io) && (!state->sparse)
+	    && (0 == pv_thread_start(state, fd)))
+		fd = -1;
+
 	while ((!(eof_in && eof_out)) || (!final_update)) {
 
 		cansend = 0;
@@ -145,20 +190,18 @@ int pv_main_loop(pvstate_t state)
 		if (state->pv_sig_abort)
 			break;
 
+		/*
+		 * The time is only read once each time round the loop, just
+		 * after the transfer, and that time is used for everything
+		 * else until the next transfer - unless we have to wait for
+		 * the rate limit, after which it is read again.
+		 */
+		pv_ratelimit_schedule(state, &cur_time);
+		pv_ratelimit_deadline(state, &cur_time, total_written);
 		if (state->rate_limit > 0) {
-			gettimeofday(&cur_time, NULL);
-			if ((cur_time.tv_sec > next_ratecheck.tv_sec)
-			    || (cur_time.tv_sec == next_ratecheck.tv_sec
-				&& cur_time.tv_usec >=
-				next_ratecheck.tv_usec)) {
-				target +=
-				    ((long double) (state->rate_limit)) /
-				    (long double) (1000000 /
-						   RATE_GRANULARITY);
-				pv_timeval_add_usec(&next_ratecheck,
-						    RATE_GRANULARITY);
-			}
-			cansend = target;
+			if (pv_ratelimit_wait(state, &cur_time))
+				pv_monotonic_time(&cur_time);
+			cansend = pv_ratelimit_allowed(state, &cur_time);
 		}
 
 		/*
@@ -180,6 +223,10 @@ int pv_main_loop(pvstate_t state)
 		if ((0 < state->size) && (state->stop_at_size)
 		    && (0 >= cansend) && eof_in && eof_out) {
 			written = 0;
+		} else if (NULL != state->threads) {
+			written =
+			    pv_thread_transfer(state, &eof_in, &eof_out,
+					       cansend, &lineswritten);
 		} else {
 			written =
 			    pv_transfer(state, fd, &eof_in, &eof_out,
@@ -192,19 +239,24 @@ int pv_main_loop(pvstate_t state)
 			return state->exit_status;
 		}
 
+		pv_transfer_writebehind(state, written);
+		if (written > 0)
+			bytes_written += written;
+
 		if (state->linemode) {
 			since_last += lineswritten;
 			total_written += lineswritten;
 			if (state->rate_limit > 0)
-				target -= lineswritten;
+				pv_ratelimit_used(state, lineswritten);
 		} else {
 			since_last += written;
 			total_written += written;
 			if (state->rate_limit > 0)
-				target -= written;
+				pv_ratelimit_used(state, written);
 		}
 
-		if (eof_in && eof_out && n < (state->input_file_count - 1)) {
+		if (eof_in && eof_out && (NULL == state->threads)
+		    && n < (state->input_file_count - 1)) {
 			n++;
 			fd = pv_next_file(state, n, fd);
 			if (fd < 0) {
@@ -216,9 +268,24 @@ int pv_main_loop(pvstate_t state)
 			eof_out = 0;
 		}
 
-		gettimeofday(&cur_time, NULL);
+		pv_monotonic_time(&cur_time);
+
+		pv_transfer_buffer_adapt(state, &cur_time);
+
+		/*
+		 * Once everything has been written, flush what is left to
+		 * disk; with --flush, that goes on in the background while
+		 * we carry on showing progress.
+		 */
+		if (eof_in && eof_out && (!final_update) && (!flushing)) {
+			pv_transfer_sparse_finish(state);
+			pv_transfer_writebehind_finish(state);
+			flushing = pv_transfer_flush_start(state);
+		}
+		if (flushing)
+			flushing = pv_transfer_flush_check(state, &flush_remaining);
 
-		if (eof_in && eof_out) {
+		if (eof_in && eof_out && (!flushing)) {
 			final_update = 1;
 			if ((state->display_visible)
 			    || (0 == state->delay_start))
@@ -256,7 +323,8 @@ int pv_main_loop(pvstate_t state)
 			 * SIGTSTOP so things don't mess up.
 			 */
 			pv_sig_nopause();
-			gettimeofday(&start_time, NULL);
+			start_time.tv_sec = cur_time.tv_sec;
+			start_time.tv_usec = cur_time.tv_usec;
 			state->pv_sig_toffset.tv_sec = 0;
 			state->pv_sig_toffset.tv_usec = 0;
 			pv_sig_allowpause();
@@ -310,7 +378,55 @@ int pv_main_loop(pvstate_t state)
 			pv_screensize(&(state->width), &(state->height));
 		}
 
-		pv_display(state, elapsed, since_last, total_written);
+		/*
+		 * Pick up the total size if it has been calculated in the
+		 * background.  If it is still being calculated at the final
+		 * update, there is no point waiting to count lines we have
+		 * already sent, so give up on it and use what we sent.
+		 */
+		pv_calc_total_size_check(state, 0);
+		if ((final_update) && (pv_calc_total_size_pending(state))) {
+			pv_calc_total_size_fini(state);
+			if (0 == state->size)
+				state->size = total_written;
+		}
+
+		/*
+		 * With write-behind, show how much of the output has
+		 * actually reached the disk, rather than how much has been
+		 * handed to the page cache; while flushing at the end, take
+		 * off the share of what we wrote that is still waiting to
+		 * be written back.
+		 */
+		if (((state->writebehind_active) && (!state->linemode))
+		    || (flushing)) {
+			long long shown;
+
+			shown = total_written;
+			if ((state->writebehind_active) && (!state->linemode))
+				shown =
+				    state->writebehind_durable -
+				    state->writebehind_start;
+			if ((flushing) && (bytes_written > 0)) {
+				if (flush_remaining > bytes_written)
+					flush_remaining = bytes_written;
+				shown -=
+				    (long long) (((long double) shown) *
+						 flush_remaining /
+						 bytes_written);
+			}
+			if (since_last >= 0) {
+				since_last = shown - display_shown;
+				if (since_last < 0)
+					since_last = 0;
+			}
+			display_shown = shown;
+			pv_display(state, elapsed, since_last, shown);
+		} else {
+			display_shown = total_written;
+			pv_display(state, elapsed, since_last,
+				   total_written);
+		}
 
 		since_last = 0;
 	}
@@ -376,8 +492,9 @@ int pv_watchfd_loop(pvstate_t state)
 		}
 	}
 
-	gettimeofday(&(info.start_time), NULL);
-	gettimeofday(&cur_time, NULL);
+	pv_monotonic_time(&(info.start_time));
+	cur_time.tv_sec = info.start_time.tv_sec;
+	cur_time.tv_usec = info.start_time.tv_usec;
 
 	next_update.tv_sec = info.start_time.tv_sec;
 	next_update.tv_usec = info.start_time.tv_usec;
@@ -420,7 +537,7 @@ int pv_watchfd_loop(pvstate_t state)
 			}
 		}
 
-		gettimeofday(&cur_time, NULL);
+		pv_monotonic_time(&cur_time);
 
 		if (ended) {
 			ended = 1;
@@ -504,7 +621,8 @@ int pv_watchpid_loop(pvstate_t state)
 	struct pvwatchfd_s *info_array = NULL;
 	struct pvstate_s *state_array = NULL;
 	int array_length = 0;
-	int fd_to_idx[FD_SETSIZE] = { 0, };
+	int *fd_to_idx = NULL;
+	int fd_to_idx_length = 0;
 	struct timeval next_update, cur_time, next_remotecheck;
 	int idx;
 	int prev_displayed_lines, blank_lines;
@@ -550,7 +668,7 @@ int pv_watchpid_loop(pvstate_t state)
 	 * Get things ready for the main loop.
 	 */
 
-	gettimeofday(&cur_time, NULL);
+	pv_monotonic_time(&cur_time);
 
 	next_remotecheck.tv_sec = cur_time.tv_sec;
 	next_remotecheck.tv_usec = cur_time.tv_usec;
@@ -560,10 +678,6 @@ int pv_watchpid_loop(pvstate_t state)
 	pv_timeval_add_usec(&next_update,
 			    (long) (1000000.0 * state->interval));
 
-	for (idx = 0; idx < FD_SETSIZE; idx++) {
-		fd_to_idx[idx] = -1;
-	}
-
 	prev_displayed_lines = 0;
 
 	while (1) {
@@ -572,7 +686,7 @@ int pv_watchpid_loop(pvstate_t state)
 		if (state->pv_sig_abort)
 			break;
 
-		gettimeofday(&cur_time, NULL);
+		pv_monotonic_time(&cur_time);
 
 		if (kill(state->watch_pid, 0) != 0) {
 			if (first_pass) {
@@ -584,6 +698,8 @@ int pv_watchpid_loop(pvstate_t state)
 					free(info_array);
 				if (NULL != state_array)
 					free(state_array);
+				if (NULL != fd_to_idx)
+					free(fd_to_idx);
 				return 2;
 			}
 			break;
@@ -625,7 +741,7 @@ int pv_watchpid_loop(pvstate_t state)
 		rc = pv_watchpid_scanfds(state, &state_copy,
 					 state->watch_pid, &array_length,
 					 &info_array, &state_array,
-					 fd_to_idx);
+					 &fd_to_idx, &fd_to_idx_length);
 		if (rc != 0) {
 			if (first_pass) {
 				pv_error(state, "%s %u: %s",
@@ -636,6 +752,8 @@ int pv_watchpid_loop(pvstate_t state)
 					free(info_array);
 				if (NULL != state_array)
 					free(state_array);
+				if (NULL != fd_to_idx)
+					free(fd_to_idx);
 				return 2;
 			}
 			break;
@@ -644,7 +762,7 @@ int pv_watchpid_loop(pvstate_t state)
 		first_pass = 0;
 		displayed_lines = 0;
 
-		for (fd = 0; fd < FD_SETSIZE; fd++) {
+		for (fd = 0; fd < fd_to_idx_length; fd++) {
 			long long position_now, since_last;
 			struct timeval init_time;
 			long double elapsed;
@@ -773,6 +891,8 @@ int pv_watchpid_loop(pvstate_t state)
 		free(info_array);
 	if (NULL != state_array)
 		free(state_array);
+	if (NULL != fd_to_idx)
+		free(fd_to_idx);
 
 	return 0;
 }
@@ -152,6 +152,188 @@ int pv_getnum_i(const char *str)
 }
 
 
+/*
+ * Return the number of seconds after midnight given by the time of day
+ * "str", as "HH:MM" or "HH:MM:SS", or -1 if it is not a valid time of day.
+ */
+long pv_getnum_clock(const char *str)
+{
+	long fields[3];
+	int count, digits;
+
+	if (0 == str)
+		return -1;
+
+	fields[0] = 0;
+	fields[1] = 0;
+	fields[2] = 0;
+
+	for (count = 0; count < 3; count++) {
+		for (digits = 0; pv__isdigit(str[0]); str++, digits++) {
+			fields[count] = fields[count] * 10;
+			fields[count] += (str[0] - '0');
+		}
+		if ((digits < 1) || (digits > 2))
+			return -1;
+		if (':' != str[0])
+			break;
+		str++;
+	}
+
+	if ((0 != str[0]) || (count < 1) || (count > 2))
+		return -1;
+
+	if ((fields[0] > 23) || (fields[1] > 59) || (fields[2] > 59))
+		return -1;
+
+	return fields[0] * 3600 + fields[1] * 60 + fields[2];
+}
+
+
+/*
+ * Return the number of seconds given by the duration "str", which is a
+ * number with an optional suffix of "s" (seconds, the default), "m"
+ * (minutes), "h" (hours), or "d" (days), or -1 if it is not a valid
+ * duration.
+ */
+double pv_getnum_duration(const char *str)
+{
+	const char *ptr;
+	double n;
+
+	if (0 == str)
+		return -1;
+
+	if (!pv__isdigit(str[0]))
+		return -1;
+
+	n = pv_getnum_d(str);
+
+	for (ptr = str; pv__isdigit(ptr[0]); ptr++);
+	if (('.' == ptr[0]) || (',' == ptr[0])) {
+		ptr++;
+		for (; pv__isdigit(ptr[0]); ptr++);
+	}
+
+	switch (ptr[0]) {
+	case 0:
+		return n;
+	case 's':
+	case 'S':
+		break;
+	case 'm':
+	case 'M':
+		n = n * 60;
+		break;
+	case 'h':
+	case 'H':
+		n = n * 3600;
+		break;
+	case 'd':
+	case 'D':
+		n = n * 86400;
+		break;
+	default:
+		return -1;
+	}
+
+	if (0 != ptr[1])
+		return -1;
+
+	return n;
+}
+
+
+/*
+ * Copy the string from "start" up to "end" into "buf", which is "size"
+ * bytes long, returning nonzero if it does not fit.
+ */
+static int pv__getnum_field(char *buf, unsigned int size,
+			    const char *start, const char *end)
+{
+	unsigned int len;
+
+	for (len = 0; (start < end) && (len + 1 < size); len++)
+		buf[len] = *(start++);
+	buf[len] = 0;
+
+	return (start < end) ? 1 : 0;
+}
+
+
+/*
+ * Parse the rate limit schedule "str", which is a comma separated list of
+ * "HH:MM[:SS]=RATE[/RAMP]" entries, each saying that from that time of day
+ * on, the rate limit is RATE (0 for no limit), changing to it gradually
+ * over the duration RAMP if given.  Up to "max" entries are stored in
+ * "entries", in the order given; "entries" may be NULL to just check the
+ * schedule.
+ *
+ * Returns the number of entries, or -1 if the schedule is not valid.
+ */
+int pv_getnum_schedule(const char *str, pv_schedule_t *entries, int max)
+{
+	char field[64];
+	const char *end;
+	long at;
+	long long rate;
+	double ramp;
+	int count;
+
+	if (0 == str)
+		return -1;
+
+	count = 0;
+
+	while (1) {
+		for (end = str; (0 != end[0]) && ('=' != end[0])
+		     && (',' != end[0]); end++);
+		if ('=' != end[0])
+			return -1;
+		if (pv__getnum_field(field, sizeof(field), str, end) != 0)
+			return -1;
+		at = pv_getnum_clock(field);
+		if (at < 0)
+			return -1;
+
+		str = end + 1;
+		for (end = str; (0 != end[0]) && ('/' != end[0])
+		     && (',' != end[0]); end++);
+		if (pv__getnum_field(field, sizeof(field), str, end) != 0)
+			return -1;
+		if (pv_getnum_check(field, PV_NUMTYPE_INTEGER) != 0)
+			return -1;
+		rate = pv_getnum_ll(field);
+
+		ramp = 0;
+		if ('/' == end[0]) {
+			str = end + 1;
+			for (end = str; (0 != end[0]) && (',' != end[0]);
+			     end++);
+			if (pv__getnum_field(field, sizeof(field), str, end)
+			    != 0)
+				return -1;
+			ramp = pv_getnum_duration(field);
+			if (ramp < 0)
+				return -1;
+		}
+
+		if ((0 != entries) && (count < max)) {
+			entries[count].at = at;
+			entries[count].rate = rate;
+			entries[count].ramp = ramp;
+		}
+		count++;
+
+		if (0 == end[0])
+			break;
+		str = end + 1;
+	}
+
+	return count;
+}
+
+
 /*
  * Return nonzero if the given string is not a valid number of the given
  * type.
@@ -0,0 +1,718 @@
+/*
+ * Functions for limiting the rate of the transfer with --rate-limit.
+ *
+ * The limit is applied with a token bucket: tokens - bytes, or lines in
+ * line mode - are added to the bucket continuously at the rate limit, up
+ * to the size of the bucket, and each transfer may only send as many as
+ * are in the bucket.  The bucket size is the largest burst that can be
+ * sent at once after a pause, and can be set with --rate-burst.
+ *
+ * So that output comes out at an even pace rather than in lumps, the main
+ * loop waits until the bucket holds about RATE_PACE_USEC worth of tokens
+ * before each transfer, sleeping until the exact time they will be there.
+ *
+ * The rate limit can also be a schedule of limits for different times of
+ * day, in which case the limit is changed as each time comes round,
+ * gradually if a ramp time was given.
+ *
+ * With --deadline, the rate limit is worked out afresh before every
+ * transfer, as the rate needed to send the rest of the data by the
+ * deadline, so that it is spread out evenly over the time allowed and
+ * any hold-ups are caught up on gradually.
+ *
+ * With --rate-group, cooperating processes share one rate limit, through
+ * a SysV shared memory segment named after the group, in which each
+ * process has a slot saying how much it is sending.  Each process still
+ * has its own bucket, but fills it at its share of the limit: whatever is
+ * left of the limit after the members that are sending less than they
+ * are allowed to have taken what they are using, divided between the
+ * members that are being held back, in proportion to their weights.
+ */
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#ifdef HAVE_IPC
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif				/* HAVE_IPC */
+
+
+#ifdef HAVE_IPC
+/*
+ * The shared memory segment of a rate group.  A process joins the group
+ * by claiming a free slot, by swapping its process ID into it, and leaves
+ * by setting it back to zero; everything else in a slot is only written
+ * by the process that owns it, so no locking is needed.
+ *
+ * Times are in microseconds on the monotonic clock, which is the same for
+ * every process.
+ */
+struct pvrategroup_s {
+	char name[64];			 /* group name, to spot key clashes */
+	struct {
+		pid_t pid;		 /* process in this slot, 0 if free */
+		unsigned int weight;	 /* its share weight */
+		unsigned long long limit; /* the rate limit it was given */
+		long double rate;	 /* the rate it is sending at */
+		long long limited;	 /* when it was last held back */
+	} member[RATE_GROUP_MEMBERS];
+};
+#endif				/* HAVE_IPC */
+
+
+#ifdef HAVE_IPC
+/*
+ * Return the microseconds on the monotonic clock at time "tv".
+ */
+static long long pv__ratelimit_usec(struct timeval *tv)
+{
+	return ((long long) (tv->tv_sec)) * 1000000 + tv->tv_usec;
+}
+
+
+/*
+ * Return the shared memory key for the rate group "name", which is
+ * specific to the current user as well as the group name, in the same way
+ * as the keys used for remote control.
+ */
+static key_t pv__ratelimit_group_key(const char *name)
+{
+	unsigned long hash;
+	const char *ptr;
+	key_t key;
+
+	hash = 5381;
+	for (ptr = name; 0 != *ptr; ptr++)
+		hash = hash * 33 + (unsigned char) (*ptr);
+	hash = hash * 33 + geteuid();
+
+	key = ftok("/tmp", 'G');
+	if (-1 == key)
+		return -1;
+
+	return key ^ (key_t) (hash & 0xFFFFFF);
+}
+
+
+/*
+ * Join the rate group given with --rate-group, attaching to its shared
+ * memory segment - creating it if we are the first - and claiming a slot
+ * in it.  On failure, a warning is shown and the rate limit applies to
+ * this process alone.
+ */
+static void pv__ratelimit_group_join(pvstate_t state, struct timeval *now)
+{
+	struct pvrategroup_s *group;
+	key_t key;
+	int shmid, slot;
+	pid_t pid;
+
+	state->rate_group_joined = 1;
+
+	key = pv__ratelimit_group_key(state->rate_group_name);
+	if (-1 == key) {
+		pv_error(state, "%s: %s: %s", state->rate_group_name,
+			 _("failed to join rate group"), strerror(errno));
+		return;
+	}
+
+	/* Catch SIGSYS in case shmget() raises it, so we get ENOSYS */
+	signal(SIGSYS, SIG_IGN);
+
+	shmid = shmget(key, sizeof(*group), 0600 | IPC_CREAT);
+	if (shmid < 0) {
+		pv_error(state, "%s: %s: %s", state->rate_group_name,
+			 _("failed to join rate group"), strerror(errno));
+		return;
+	}
+
+	group = shmat(shmid, 0, 0);
+	if ((void *) -1 == group) {
+		pv_error(state, "%s: %s: %s", state->rate_group_name,
+			 _("failed to join rate group"), strerror(errno));
+		return;
+	}
+
+	/*
+	 * The name is filled in by whoever gets there first; if it is
+	 * some other name, two group names have the same key.
+	 */
+	if (0 == group->name[0]) {
+		snprintf(group->name, sizeof(group->name), "%.*s",
+			 (int) (sizeof(group->name) - 1),
+			 state->rate_group_name);
+	} else if (0 !=
+		   strncmp(group->name, state->rate_group_name,
+			   sizeof(group->name) - 1)) {
+		pv_error(state, "%s: %s", state->rate_group_name,
+			 _("rate group name clashes with another group"));
+		shmdt((void *) group);
+		return;
+	}
+
+	/*
+	 * Claim the first slot that is free, or whose process has gone
+	 * away without leaving.
+	 */
+	pid = getpid();
+	for (slot = 0; slot < RATE_GROUP_MEMBERS; slot++) {
+		pid_t owner;
+
+		owner =
+		    __atomic_load_n(&(group->member[slot].pid),
+				    __ATOMIC_ACQUIRE);
+		if ((0 != owner) && ((0 == kill(owner, 0))
+				     || (ESRCH != errno)))
+			continue;
+		if (__atomic_compare_exchange_n
+		    (&(group->member[slot].pid), &owner, pid, 0,
+		     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	if (slot >= RATE_GROUP_MEMBERS) {
+		pv_error(state, "%s: %s", state->rate_group_name,
+			 _("rate group is full"));
+		shmdt((void *) group);
+		return;
+	}
+
+	group->member[slot].weight = state->rate_group_weight;
+	group->member[slot].limit = state->rate_limit_given;
+	group->member[slot].rate = 0;
+	group->member[slot].limited = pv__ratelimit_usec(now);
+
+	debug("%s: %s: %d", state->rate_group_name,
+	      "joined rate group as slot", slot);
+
+	state->rate_group = group;
+	state->rate_group_shmid = shmid;
+	state->rate_group_slot = slot;
+	state->rate_group_sent = 0;
+	state->rate_group_sampled.tv_sec = now->tv_sec;
+	state->rate_group_sampled.tv_usec = now->tv_usec;
+}
+
+
+/*
+ * Publish the rate we are sending at, every RATE_GROUP_SAMPLE_USEC, and
+ * return our share of the group's rate limit as of time "now".
+ *
+ * The group's limit is the lowest one given to any member that is being
+ * held back or was so within the last RATE_GROUP_ACTIVE_USEC, including
+ * us; those members share what the others are not using, in proportion
+ * to their weights.  The limit published is the one given, not the one
+ * lowered for --deadline, so that our deadline does not hold back the
+ * rest of the group.
+ */
+static long double pv__ratelimit_group_rate(pvstate_t state,
+					    struct timeval *now)
+{
+	struct pvrategroup_s *group;
+	long double limit, spare, weights, share;
+	long long now_usec, elapsed;
+	int slot;
+
+	group = state->rate_group;
+	now_usec = pv__ratelimit_usec(now);
+
+	elapsed = now_usec - pv__ratelimit_usec(&(state->rate_group_sampled));
+	if (elapsed >= RATE_GROUP_SAMPLE_USEC) {
+		group->member[state->rate_group_slot].rate =
+		    state->rate_group_sent * 1000000.0 / elapsed;
+		group->member[state->rate_group_slot].limit =
+		    state->rate_limit_given;
+		state->rate_group_sent = 0;
+		state->rate_group_sampled.tv_sec = now->tv_sec;
+		state->rate_group_sampled.tv_usec = now->tv_usec;
+	}
+
+	limit = state->rate_limit_given;
+	weights = 0;
+	spare = 0;
+
+	for (slot = 0; slot < RATE_GROUP_MEMBERS; slot++) {
+		pid_t owner;
+
+		owner =
+		    __atomic_load_n(&(group->member[slot].pid),
+				    __ATOMIC_ACQUIRE);
+		if (0 == owner)
+			continue;
+
+		if ((slot == state->rate_group_slot)
+		    || (now_usec - group->member[slot].limited <=
+			RATE_GROUP_ACTIVE_USEC)) {
+			weights += group->member[slot].weight;
+			if ((group->member[slot].limit > 0)
+			    && (group->member[slot].limit < limit))
+				limit = group->member[slot].limit;
+		} else {
+			spare += group->member[slot].rate;
+		}
+	}
+
+	/*
+	 * Whatever the others are doing, always allow ourselves a small
+	 * share, so that we can't be starved completely.
+	 */
+	spare = limit - spare;
+	if (spare < limit / RATE_GROUP_MEMBERS)
+		spare = limit / RATE_GROUP_MEMBERS;
+
+	if (weights < 1)
+		weights = 1;
+
+	share = spare * state->rate_group_weight / weights;
+	if (share < 1)
+		share = 1;
+
+	return share;
+}
+#endif				/* HAVE_IPC */
+
+
+/*
+ * Return the rate at which the bucket is filled as of time "now": the rate
+ * limit, or with --rate-group, our share of it; either way, no faster than
+ * the rate needed to meet the --deadline.
+ */
+static long double pv__ratelimit_rate(pvstate_t state, struct timeval *now)
+{
+	long double rate;
+
+	rate = state->rate_limit;
+#ifdef HAVE_IPC
+	if ((NULL != state->rate_group_name) && (!state->rate_group_joined))
+		pv__ratelimit_group_join(state, now);
+	if (NULL != state->rate_group)
+		rate = pv__ratelimit_group_rate(state, now);
+#endif				/* HAVE_IPC */
+	if ((state->rate_deadline > 0) && (state->rate_deadline < rate))
+		rate = state->rate_deadline;
+	return rate;
+}
+
+
+/*
+ * Return the number of tokens to wait for before each transfer: the number
+ * added in RATE_PACE_USEC microseconds, but at least 1.
+ */
+static long double pv__ratelimit_pace(pvstate_t state)
+{
+	long double pace;
+
+	pace = state->rate_current * RATE_PACE_USEC / 1000000.0;
+	if (pace < 1)
+		pace = 1;
+
+	return pace;
+}
+
+
+/*
+ * Return the size of the bucket: the burst size given with --rate-burst,
+ * or RATE_BURST_USEC worth of tokens by default, but never less than the
+ * number we wait for before each transfer.
+ */
+static long double pv__ratelimit_bucket(pvstate_t state)
+{
+	long double bucket, pace;
+
+	if (state->rate_burst > 0) {
+		bucket = state->rate_burst;
+	} else {
+		bucket = state->rate_current * RATE_BURST_USEC / 1000000.0;
+	}
+
+	pace = pv__ratelimit_pace(state);
+	if (bucket < pace)
+		bucket = pace;
+
+	return bucket;
+}
+
+
+/*
+ * Add tokens to the bucket for the time that has passed between the last
+ * call and "now", and return the number of whole tokens in it, which is
+ * how much may be sent.
+ *
+ * The bucket starts off empty, so the transfer starts at the limited rate
+ * rather than with a burst.
+ */
+unsigned long long pv_ratelimit_allowed(pvstate_t state,
+					struct timeval *now)
+{
+	long double elapsed, bucket;
+
+	if (0 == state->rate_limit)
+		return 0;
+
+	if ((0 == state->rate_time.tv_sec) && (0 == state->rate_time.tv_usec)) {
+		state->rate_time.tv_sec = now->tv_sec;
+		state->rate_time.tv_usec = now->tv_usec;
+		state->rate_tokens = 0;
+	}
+
+	state->rate_current = pv__ratelimit_rate(state, now);
+
+	elapsed = now->tv_sec - state->rate_time.tv_sec;
+	elapsed += (now->tv_usec - state->rate_time.tv_usec) / 1000000.0;
+
+	if (elapsed > 0) {
+		state->rate_tokens += state->rate_current * elapsed;
+		state->rate_time.tv_sec = now->tv_sec;
+		state->rate_time.tv_usec = now->tv_usec;
+	}
+
+	bucket = pv__ratelimit_bucket(state);
+	if (state->rate_tokens > bucket)
+		state->rate_tokens = bucket;
+
+	if (state->rate_tokens < 1)
+		return 0;
+
+	return (unsigned long long) (state->rate_tokens);
+}
+
+
+/*
+ * Take "amount" tokens out of the bucket, after that many bytes or lines
+ * have been sent.
+ */
+void pv_ratelimit_used(pvstate_t state, long amount)
+{
+	if (amount <= 0)
+		return;
+	state->rate_tokens -= amount;
+#ifdef HAVE_IPC
+	state->rate_group_sent += amount;
+#endif				/* HAVE_IPC */
+}
+
+
+/*
+ * If the bucket holds fewer tokens than we wait for before each transfer,
+ * sleep until it will hold enough, as of the last call to
+ * pv_ratelimit_allowed() at time "now", but for no longer than
+ * TRANSFER_READ_TIMEOUT microseconds, so that the display, remote control
+ * messages, and signals are still seen to promptly at very low rates.
+ *
+ * Returns nonzero if we slept, in which case the time needs to be read
+ * again.
+ */
+int pv_ratelimit_wait(pvstate_t state, struct timeval *now)
+{
+	long double needed;
+	long usec;
+
+	if ((0 == state->rate_limit) || (state->rate_current <= 0))
+		return 0;
+
+	needed = pv__ratelimit_pace(state) - state->rate_tokens;
+	if (needed <= 0)
+		return 0;
+
+#ifdef HAVE_IPC
+	/*
+	 * Let the rest of the group know that we are being held back -
+	 * unless it is only our deadline holding us back, in which case
+	 * our share is not all being used.
+	 */
+	if ((NULL != state->rate_group)
+	    && ((state->rate_deadline <= 0)
+		|| (state->rate_current < state->rate_deadline)))
+		state->rate_group->member[state->rate_group_slot].limited =
+		    pv__ratelimit_usec(now);
+#endif				/* HAVE_IPC */
+
+	usec = (long) (needed * 1000000.0 / state->rate_current) + 1;
+	if (usec > TRANSFER_READ_TIMEOUT)
+		usec = TRANSFER_READ_TIMEOUT;
+
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+	{
+		struct timespec until;
+
+		/*
+		 * Sleep until an absolute time on the same clock as "now",
+		 * so that the time taken since "now" was read is allowed
+		 * for, and an interrupted sleep can be carried on.
+		 */
+		until.tv_sec = now->tv_sec;
+		until.tv_nsec = (now->tv_usec + usec) * 1000L;
+		while (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		while (EINTR ==
+		       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+				       NULL)) {
+			if (state->pv_sig_abort)
+				break;
+		}
+	}
+#else				/* !(CLOCK_MONOTONIC && TIMER_ABSTIME) */
+	{
+		struct timeval tv;
+
+		tv.tv_sec = usec / 1000000;
+		tv.tv_usec = usec % 1000000;
+		select(0, NULL, NULL, NULL, &tv);
+	}
+#endif				/* CLOCK_MONOTONIC && TIMER_ABSTIME */
+
+	return 1;
+}
+
+/*
+ * Compare two schedule entries by time of day, for qsort().
+ */
+static int pv__ratelimit_schedule_cmp(const void *a, const void *b)
+{
+	const pv_schedule_t *first = a;
+	const pv_schedule_t *second = b;
+
+	if (first->at < second->at)
+		return -1;
+	if (first->at > second->at)
+		return 1;
+	return 0;
+}
+
+
+/*
+ * Parse the schedule given with --rate-limit into state->rate_schedule,
+ * sorted by time of day.  The schedule has already been checked when the
+ * options were parsed.
+ */
+static void pv__ratelimit_schedule_load(pvstate_t state)
+{
+	pv_schedule_t *entries;
+	int count;
+
+	state->rate_schedule_loaded = 1;
+
+	count = pv_getnum_schedule(state->rate_schedule_spec, NULL, 0);
+	if (count < 1)
+		return;
+
+	entries = calloc(count, sizeof(*entries));
+	if (NULL == entries) {
+		pv_error(state, "%s: %s", _("buffer allocation failed"),
+			 strerror(errno));
+		state->exit_status |= 64;
+		return;
+	}
+
+	pv_getnum_schedule(state->rate_schedule_spec, entries, count);
+	qsort(entries, count, sizeof(*entries), pv__ratelimit_schedule_cmp);
+
+	state->rate_schedule = entries;
+	state->rate_schedule_count = count;
+}
+
+
+/*
+ * Return the rate limit the schedule gives for "sec" seconds after
+ * midnight.
+ *
+ * The entry in force is the last one at or before "sec", or if there is
+ * none, the last one of the day before.  If it has a ramp time, and we
+ * are still within it, the rate is part of the way from the previous
+ * entry's rate to its own; a change to or from no limit at all can't be
+ * ramped, and happens at once.
+ */
+static long double pv__ratelimit_schedule_rate(pvstate_t state, double sec)
+{
+	pv_schedule_t *current, *previous;
+	double since;
+	int idx, count;
+
+	count = state->rate_schedule_count;
+
+	for (idx = count - 1; idx > 0; idx--) {
+		if (state->rate_schedule[idx].at <= sec)
+			break;
+	}
+	if (state->rate_schedule[idx].at > sec)
+		idx = count - 1;
+
+	current = &(state->rate_schedule[idx]);
+	previous = &(state->rate_schedule[(idx + count - 1) % count]);
+
+	since = sec - current->at;
+	if (since < 0)
+		since += 86400;
+
+	if ((current->ramp > 0) && (since < current->ramp)
+	    && (current->rate > 0) && (previous->rate > 0)) {
+		return previous->rate +
+		    ((long double) (current->rate) -
+		     (long double) (previous->rate)) * since / current->ramp;
+	}
+
+	return current->rate;
+}
+
+
+/*
+ * With a schedule given to --rate-limit, set the rate limit to the one the
+ * schedule gives for the current time of day, looking at the clock every
+ * RATE_SCHEDULE_USEC microseconds by the monotonic time "now".
+ *
+ * The limit is only changed when the schedule's rate changes, so that a
+ * new limit sent with --remote lasts until the next change.
+ */
+void pv_ratelimit_schedule(pvstate_t state, struct timeval *now)
+{
+	unsigned long long rate;
+	struct timeval tv;
+	struct tm *tm;
+	time_t seconds;
+	long long elapsed;
+	int first;
+
+	if (NULL == state->rate_schedule_spec)
+		return;
+
+	if (!state->rate_schedule_loaded)
+		pv__ratelimit_schedule_load(state);
+	if (0 == state->rate_schedule_count)
+		return;
+
+	first = ((0 == state->rate_schedule_checked.tv_sec)
+		 && (0 == state->rate_schedule_checked.tv_usec)) ? 1 : 0;
+
+	elapsed =
+	    ((long long) (now->tv_sec - state->rate_schedule_checked.tv_sec))
+	    * 1000000 + (now->tv_usec - state->rate_schedule_checked.tv_usec);
+	if ((!first) && (elapsed < RATE_SCHEDULE_USEC))
+		return;
+
+	state->rate_schedule_checked.tv_sec = now->tv_sec;
+	state->rate_schedule_checked.tv_usec = now->tv_usec;
+
+	gettimeofday(&tv, NULL);
+	seconds = tv.tv_sec;
+	tm = localtime(&seconds);
+	if (NULL == tm)
+		return;
+
+	rate = (unsigned long long)
+	    (pv__ratelimit_schedule_rate
+	     (state,
+	      tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec +
+	      tv.tv_usec / 1000000.0) + 0.5);
+
+	if ((!first) && (rate == state->rate_schedule_applied))
+		return;
+
+	debug("%s: %llu", "scheduled rate limit", rate);
+
+	state->rate_schedule_applied = rate;
+	state->rate_limit = rate;
+	state->rate_limit_given = rate;
+}
+
+
+/*
+ * With --deadline, set the rate limit to the rate needed to send what is
+ * left of the data by the deadline, as of time "now", when "transferred"
+ * bytes (or lines) have been sent so far.  The rate never goes above the
+ * limit given with --rate-limit, if any, and once the deadline has come,
+ * that limit is all that applies.
+ *
+ * The total size has to be known, so if lines are still being counted in
+ * the background, we wait for the count to finish.
+ */
+void pv_ratelimit_deadline(pvstate_t state, struct timeval *now,
+			   long long transferred)
+{
+	long double left, rate;
+	long long remaining;
+
+	if ((0 == state->deadline.tv_sec) && (0 == state->deadline.tv_usec))
+		return;
+
+	state->rate_deadline = 0;
+	state->rate_limit = state->rate_limit_given;
+
+	if (state->size <= 0)
+		pv_calc_total_size_check(state, 1);
+
+	if (state->size <= 0) {
+		pv_error(state, "%s",
+			 _("deadline ignored: total size unknown"));
+		state->deadline.tv_sec = 0;
+		state->deadline.tv_usec = 0;
+		return;
+	}
+
+	remaining = state->size - transferred;
+	if (remaining <= 0)
+		return;
+
+	left = state->deadline.tv_sec - now->tv_sec;
+	left += (state->deadline.tv_usec - now->tv_usec) / 1000000.0;
+	if (left <= 0)
+		return;
+
+	rate = remaining / left;
+	if ((state->rate_limit_given > 0)
+	    && (rate >= state->rate_limit_given))
+		return;
+
+	state->rate_deadline = rate;
+	state->rate_limit = 1 + (unsigned long long) rate;
+}
+
+
+/*
+ * Free the rate limit schedule, and leave the rate group, if we are in
+ * one, removing its shared memory segment if we were the last process
+ * attached to it.
+ */
+void pv_ratelimit_fini(pvstate_t state)
+{
+#ifdef HAVE_IPC
+	struct shmid_ds buf;
+#endif				/* HAVE_IPC */
+
+	if (NULL == state)
+		return;
+
+	if (NULL != state->rate_schedule)
+		free(state->rate_schedule);
+	state->rate_schedule = NULL;
+	state->rate_schedule_count = 0;
+
+#ifdef HAVE_IPC
+	if (NULL == state->rate_group)
+		return;
+
+	__atomic_store_n(&(state->rate_group->member[state->rate_group_slot].
+			   pid), 0, __ATOMIC_RELEASE);
+	shmdt((void *) (state->rate_group));
+	state->rate_group = NULL;
+
+	buf.shm_nattch = 0;
+	if ((0 == shmctl(state->rate_group_shmid, IPC_STAT, &buf))
+	    && (0 == buf.shm_nattch))
+		shmctl(state->rate_group_shmid, IPC_RMID, 0);
+#endif				/* HAVE_IPC */
+}
+
+/* EOF */
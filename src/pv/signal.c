@@ -47,7 +47,7 @@ static void pv_sig_ttou(int s)
  */
 static void pv_sig_tstp(int s)
 {
-	gettimeofday(&(pv_sig_state->pv_sig_tstp_time), NULL);
+	pv_monotonic_time(&(pv_sig_state->pv_sig_tstp_time));
 	raise(SIGSTOP);
 }
 
@@ -74,7 +74,7 @@ static void pv_sig_cont(int s)
 		return;
 	}
 
-	gettimeofday(&tv, NULL);
+	pv_monotonic_time(&tv);
 
 	pv_sig_state->pv_sig_toffset.tv_sec +=
 	    (tv.tv_sec - pv_sig_state->pv_sig_tstp_time.tv_sec);
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 
 /*
@@ -33,7 +34,16 @@ pvstate_t pv_state_alloc(const char *program_name)
 	state->current_file = _("none");
 #ifdef HAVE_SPLICE
 	state->splice_failed_fd = -1;
+	state->splice_checked_fd = -1;
+	state->splice_pipe_fd[0] = -1;
+	state->splice_pipe_fd[1] = -1;
 #endif				/* HAVE_SPLICE */
+#ifdef HAVE_LINUX_IO_URING_H
+	state->uring_failed_fd = -1;
+#endif				/* HAVE_LINUX_IO_URING_H */
+	state->direct_input_fd = -1;
+	state->advise_fd = -1;
+	state->sparse_input_fd = -1;
 	state->display_visible = 0;
 
 	return state;
@@ -52,8 +62,13 @@ void pv_state_free(pvstate_t state)
 		free(state->display_buffer);
 	state->display_buffer = NULL;
 
-	if (state->transfer_buffer)
-		free(state->transfer_buffer);
+	pv_calc_total_size_fini(state);
+	pv_thread_fini(state);
+	pv_transfer_fini(state);
+	pv_ratelimit_fini(state);
+
+	pv_transfer_buffer_free(state, state->transfer_buffer,
+				state->buffer_size);
 	state->transfer_buffer = NULL;
 
 	free(state);
@@ -134,6 +149,11 @@ void pv_state_null_set(pvstate_t state, unsigned char val)
 	state->null = val;
 };
 
+void pv_state_line_cache_set(pvstate_t state, unsigned char val)
+{
+	state->line_cache = val;
+};
+
 void pv_state_no_op_set(pvstate_t state, unsigned char val)
 {
 	state->no_op = val;
@@ -152,12 +172,65 @@ void pv_state_stop_at_size_set(pvstate_t state, unsigned char val)
 void pv_state_rate_limit_set(pvstate_t state, unsigned long long val)
 {
 	state->rate_limit = val;
+	state->rate_limit_given = val;
+};
+
+void pv_state_rate_burst_set(pvstate_t state, unsigned long long val)
+{
+	state->rate_burst = val;
+};
+
+void pv_state_rate_group_set(pvstate_t state, const char *name,
+			     unsigned int weight)
+{
+	state->rate_group_name = name;
+	state->rate_group_weight = weight;
+};
+
+void pv_state_rate_schedule_set(pvstate_t state, const char *val)
+{
+	state->rate_schedule_spec = val;
+};
+
+/*
+ * Set the deadline to "val" seconds from now, or clear it if "val" is
+ * zero.  We aim to finish a little early - by 1% of the time, but no more
+ * than DEADLINE_MARGIN_MAX seconds - so that the deadline is still met if
+ * the transfer is held up towards the end.
+ */
+void pv_state_deadline_set(pvstate_t state, double val)
+{
+	double margin;
+
+	state->deadline.tv_sec = 0;
+	state->deadline.tv_usec = 0;
+	if (val <= 0)
+		return;
+
+	margin = val / 100;
+	if (margin > DEADLINE_MARGIN_MAX)
+		margin = DEADLINE_MARGIN_MAX;
+	val -= margin;
+
+	pv_monotonic_time(&(state->deadline));
+	state->deadline.tv_sec += (time_t) val;
+	state->deadline.tv_usec += (long) ((val - (time_t) val) * 1000000);
+	if (state->deadline.tv_usec >= 1000000) {
+		state->deadline.tv_sec++;
+		state->deadline.tv_usec -= 1000000;
+	}
 };
 
 void pv_state_target_buffer_size_set(pvstate_t state,
 				     unsigned long long val)
 {
 	state->target_buffer_size = val;
+	state->buffer_adaptive = (0 == val) ? 1 : 0;
+};
+
+void pv_state_pipe_size_set(pvstate_t state, unsigned long long val)
+{
+	state->pipe_size = val;
 };
 
 void pv_state_no_splice_set(pvstate_t state, unsigned char val)
@@ -165,6 +238,63 @@ void pv_state_no_splice_set(pvstate_t state, unsigned char val)
 	state->no_splice = val;
 };
 
+void pv_state_splice_pipe_set(pvstate_t state, unsigned char val)
+{
+	state->splice_pipe = val;
+};
+
+void pv_state_direct_io_set(pvstate_t state, unsigned char val)
+{
+	long pagesize;
+
+	state->direct_io = val;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize < 512)
+		pagesize = 4096;
+	state->direct_align = pagesize;
+};
+
+void pv_state_drop_cache_set(pvstate_t state, unsigned char val)
+{
+	state->drop_cache = val;
+};
+
+void pv_state_write_behind_set(pvstate_t state, unsigned char val)
+{
+	state->write_behind = val;
+};
+
+void pv_state_flush_set(pvstate_t state, unsigned char val)
+{
+	state->flush = val;
+};
+
+void pv_state_sparse_set(pvstate_t state, unsigned char val)
+{
+	state->sparse = val;
+};
+
+void pv_state_huge_pages_set(pvstate_t state, unsigned char val)
+{
+	state->huge_pages = val;
+};
+
+void pv_state_mlock_set(pvstate_t state, unsigned char val)
+{
+	state->mlock = val;
+};
+
+void pv_state_io_uring_set(pvstate_t state, unsigned char val)
+{
+	state->io_uring = val;
+};
+
+void pv_state_threaded_set(pvstate_t state, unsigned char val)
+{
+	state->threaded = val;
+};
+
 void pv_state_size_set(pvstate_t state, unsigned long long val)
 {
 	state->size = val;
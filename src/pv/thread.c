@@ -0,0 +1,805 @@
+/*
+ * Functions for transferring data using separate reader and writer
+ * threads.
+ *
+ * The reader thread reads the input files in turn into the transfer
+ * buffer, which is treated as a ring, and the writer thread writes from
+ * the ring to standard output, so that a slow write does not hold up the
+ * next read or the other way round.  The main loop only reads the
+ * counters the threads publish, and publishes the limit on how much may
+ * be written - in bytes, or in lines in line mode - for rate limiting and
+ * --stop-at-size.
+ *
+ * The threads never touch the rest of the shared state: when the reader
+ * reaches the end of a file or gets a read error, it asks the main thread
+ * to deal with it and waits for the answer, and when the writer fails, it
+ * publishes the error for the main thread to report.  So opening files,
+ * reporting errors, and setting the exit status all happen in the main
+ * thread, as they do without threads.
+ *
+ * There is one producer and one consumer, so the ring needs no locking:
+ * the reader only ever advances "read_total" and the writer only ever
+ * advances "write_total", with the data between the two belonging to the
+ * writer and the rest of the buffer belonging to the reader.  The mutex
+ * and condition variable are only used to sleep when there is nothing to
+ * do, and are not touched while data is flowing.
+ */
+
+#include "pv-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+
+#define PV_THREAD_NO_LIMIT	(~0ULL)
+
+#define PV_THREAD_READ_ERROR	1	 /* request: deal with a read error */
+#define PV_THREAD_NEXT_FILE	2	 /* request: move to the next file */
+
+/*
+ * State shared between the main loop and the reader and writer threads.
+ */
+struct pvthreads_s {
+	pthread_t reader;
+	pthread_t writer;
+	unsigned char reader_started;
+	unsigned char writer_started;
+
+	/*
+	 * Counters published by the threads, only ever increasing.
+	 */
+	unsigned long long read_total;	 /* bytes read into the ring */
+	unsigned long long write_total;	 /* bytes written from the ring */
+	unsigned long long lines_total;	 /* lines written, in line mode */
+	int reader_done;		 /* set when the reader has finished */
+	int writer_done;		 /* set when the writer has finished */
+	int input_failed;		 /* set if an input file failed */
+	int output_failed;		 /* set if writing failed */
+	int output_errno;		 /* errno of the failed write */
+
+	/*
+	 * A request from the reader to the main thread: the reader fills
+	 * in the details, then sets "request" to a PV_THREAD_* value and
+	 * waits; the main thread deals with it, fills in "reply", and sets
+	 * "request" back to zero.
+	 */
+	int request;
+	int request_errno;		 /* errno of the failed read */
+	unsigned long request_length;	 /* length of the failed read */
+	unsigned long request_errors;	 /* failed reads in a row */
+	long reply;			 /* bytes skipped, or -1 to stop */
+
+	/*
+	 * Published by the main loop: the value write_total, or in line
+	 * mode lines_total, may not go past, and a flag telling the threads
+	 * to stop.
+	 */
+	unsigned long long write_limit;
+	unsigned long long line_limit;
+	int stop;
+
+	/*
+	 * Used by the main loop to work out what has changed since it last
+	 * looked.
+	 */
+	unsigned long long reported_total;
+	unsigned long long reported_lines;
+	unsigned long long advised_total; /* read_total seen by the advice */
+	int filenum;			 /* number of the current input file */
+
+	/*
+	 * Used only for sleeping and waking: "events" is incremented every
+	 * time a counter or flag above changes, and a thread which wants
+	 * to sleep until something changes waits for it to move on from
+	 * the value it last saw.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	clockid_t clock;		 /* clock that "cond" times out by */
+	unsigned long events;
+	int sleepers;
+
+	/*
+	 * Last bytes written, for --last-written; protected by "lock".
+	 */
+	unsigned char lastoutput[sizeof(((struct pvstate_s *) 0)->
+				       lastoutput_buffer)];
+
+	/*
+	 * The input fd, which the reader reads from; it is only ever
+	 * opened, changed, or closed by the main thread, while the reader
+	 * is waiting for a request to be dealt with, or has finished.
+	 */
+	int fd;
+};
+
+
+/*
+ * Tell any sleeping threads that something has changed.
+ */
+static void pv__thread_wake(struct pvthreads_s *threads)
+{
+	__atomic_add_fetch(&(threads->events), 1, __ATOMIC_SEQ_CST);
+	if (0 == __atomic_load_n(&(threads->sleepers), __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&(threads->lock));
+	pthread_cond_broadcast(&(threads->cond));
+	pthread_mutex_unlock(&(threads->lock));
+}
+
+
+/*
+ * Return the current event count, to pass to pv__thread_sleep() later.
+ */
+static unsigned long pv__thread_events(struct pvthreads_s *threads)
+{
+	return __atomic_load_n(&(threads->events), __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Sleep until something has changed since the event count was "events",
+ * or until "usec" microseconds have passed.
+ */
+static void pv__thread_sleep(struct pvthreads_s *threads,
+			     unsigned long events, long usec)
+{
+	struct timespec until;
+
+	clock_gettime(threads->clock, &until);
+	until.tv_nsec += usec * 1000;
+	while (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&(threads->lock));
+	__atomic_add_fetch(&(threads->sleepers), 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(threads->events), __ATOMIC_SEQ_CST) == events)
+		pthread_cond_timedwait(&(threads->cond), &(threads->lock),
+				       &until);
+	__atomic_sub_fetch(&(threads->sleepers), 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(threads->lock));
+}
+
+
+/*
+ * Ask the main thread to deal with "request", and wait for it to do so,
+ * returning its reply, or -1 if we are told to stop first.
+ */
+static long pv__thread_request(struct pvthreads_s *threads, int request)
+{
+	__atomic_store_n(&(threads->request), request, __ATOMIC_RELEASE);
+	pv__thread_wake(threads);
+
+	while (!__atomic_load_n(&(threads->stop), __ATOMIC_ACQUIRE)) {
+		unsigned long events;
+
+		events = pv__thread_events(threads);
+		if (0 == __atomic_load_n(&(threads->request), __ATOMIC_ACQUIRE))
+			return threads->reply;
+		pv__thread_sleep(threads, events, TRANSFER_READ_TIMEOUT);
+	}
+
+	return -1;
+}
+
+
+/*
+ * Reader thread: read each input file in turn into the ring, until there
+ * are no more files, or we are told to stop.
+ */
+static void *pv__thread_reader(void *arg)
+{
+	pvstate_t state = arg;
+	struct pvthreads_s *threads = state->threads;
+	unsigned long long read_total;
+	unsigned long errors;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	read_total = 0;
+	errors = 0;
+
+	while (!__atomic_load_n(&(threads->stop), __ATOMIC_ACQUIRE)) {
+		unsigned long long used;
+		unsigned long offset, length;
+		unsigned long events;
+		ssize_t nread;
+		long skipped;
+
+		events = pv__thread_events(threads);
+
+		used = read_total -
+		    __atomic_load_n(&(threads->write_total),
+				    __ATOMIC_ACQUIRE);
+		if (used >= state->buffer_size) {
+			pv__thread_sleep(threads, events,
+					 TRANSFER_READ_TIMEOUT);
+			continue;
+		}
+
+		offset = read_total % state->buffer_size;
+		length = state->buffer_size - used;
+		if (length > state->buffer_size - offset)
+			length = state->buffer_size - offset;
+		if (length > MAX_READ_AT_ONCE)
+			length = MAX_READ_AT_ONCE;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		nread =
+		    read(threads->fd, state->transfer_buffer + offset,
+			 length);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (nread > 0) {
+			errors = 0;
+			read_total += nread;
+			__atomic_store_n(&(threads->read_total), read_total,
+					 __ATOMIC_RELEASE);
+			pv__thread_wake(threads);
+			continue;
+		}
+
+		if ((nread < 0) && ((EINTR == errno) || (EAGAIN == errno))) {
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 10000;
+			select(0, NULL, NULL, NULL, &tv);
+			continue;
+		}
+
+		/*
+		 * A read error is reported, and maybe skipped past, by the
+		 * main thread; if it was skipped, the skipped part is
+		 * filled with zeroes.
+		 */
+		if (nread < 0) {
+			errors++;
+			threads->request_errno = errno;
+			threads->request_length = length;
+			threads->request_errors = errors;
+			skipped =
+			    pv__thread_request(threads,
+					       PV_THREAD_READ_ERROR);
+			if (skipped > 0) {
+				memset(state->transfer_buffer + offset, 0,
+				       skipped);
+				read_total += skipped;
+				__atomic_store_n(&(threads->read_total),
+						 read_total,
+						 __ATOMIC_RELEASE);
+				pv__thread_wake(threads);
+				continue;
+			}
+		}
+
+		/*
+		 * End of this file - have the main thread move on to the
+		 * next one, if there is one.
+		 */
+		errors = 0;
+		if (pv__thread_request(threads, PV_THREAD_NEXT_FILE) < 0)
+			break;
+	}
+
+	__atomic_store_n(&(threads->reader_done), 1, __ATOMIC_RELEASE);
+	pv__thread_wake(threads);
+
+	return NULL;
+}
+
+
+/*
+ * Keep a copy of the last few bytes written, for --last-written, given
+ * that "length" bytes have just been written from "buf".
+ */
+static void pv__thread_lastoutput(struct pvthreads_s *threads,
+				  unsigned char *buf, unsigned long length)
+{
+	unsigned long keep;
+
+	keep = sizeof(threads->lastoutput);
+
+	pthread_mutex_lock(&(threads->lock));
+	if (length >= keep) {
+		memcpy(threads->lastoutput, buf + length - keep, keep);
+	} else {
+		memmove(threads->lastoutput, threads->lastoutput + length,
+			keep - length);
+		memcpy(threads->lastoutput + keep - length, buf, length);
+	}
+	pthread_mutex_unlock(&(threads->lock));
+}
+
+
+/*
+ * Writer thread: write data from the ring to standard output as it
+ * arrives, within the limit set by the main loop, until the reader has
+ * finished and everything it read has been written.
+ */
+static void *pv__thread_writer(void *arg)
+{
+	pvstate_t state = arg;
+	struct pvthreads_s *threads = state->threads;
+	unsigned long long write_total, read_total, limit, available;
+	unsigned long long lines_total, line_limit, records;
+	unsigned char line_end;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	write_total = 0;
+	lines_total = 0;
+	line_end = state->null ? 0 : '\n';
+
+	while (!__atomic_load_n(&(threads->stop), __ATOMIC_ACQUIRE)) {
+		unsigned long offset, length;
+		unsigned long events;
+		unsigned char *start;
+		int reader_done;
+		ssize_t nwritten;
+
+		events = pv__thread_events(threads);
+
+		/*
+		 * Check whether the reader has finished before looking at
+		 * how much it has read, so that if it has finished, we know
+		 * we've seen everything it read.
+		 */
+		reader_done =
+		    __atomic_load_n(&(threads->reader_done),
+				    __ATOMIC_ACQUIRE);
+		read_total =
+		    __atomic_load_n(&(threads->read_total),
+				    __ATOMIC_ACQUIRE);
+		limit =
+		    __atomic_load_n(&(threads->write_limit),
+				    __ATOMIC_ACQUIRE);
+		line_limit =
+		    __atomic_load_n(&(threads->line_limit),
+				    __ATOMIC_ACQUIRE);
+
+		available = read_total - write_total;
+		if (limit < read_total)
+			available =
+			    limit > write_total ? limit - write_total : 0;
+
+		records = PV_THREAD_NO_LIMIT;
+		if (line_limit != PV_THREAD_NO_LIMIT) {
+			records =
+			    line_limit >
+			    lines_total ? line_limit - lines_total : 0;
+			if (0 == records)
+				available = 0;
+		}
+
+		if (0 == available) {
+			if (reader_done && (write_total >= read_total))
+				break;
+			pv__thread_sleep(threads, events,
+					 TRANSFER_READ_TIMEOUT);
+			continue;
+		}
+
+		offset = write_total % state->buffer_size;
+		length = available;
+		if (length > state->buffer_size - offset)
+			length = state->buffer_size - offset;
+		if (length > MAX_WRITE_AT_ONCE)
+			length = MAX_WRITE_AT_ONCE;
+
+		start = state->transfer_buffer + offset;
+
+		/*
+		 * In line mode, only write up to the end of the lines we
+		 * are allowed to write, and only up to and including the
+		 * last line terminator, so that we're writing output
+		 * line-by-line.  When the main loop has set a limit on the
+		 * lines - when rate limiting - a partial line on its own is
+		 * held back until the rest of it arrives, as in
+		 * pv_transfer().
+		 */
+		if (state->linemode) {
+			unsigned long whole;
+			long idx;
+
+			whole = length;
+			if (records != PV_THREAD_NO_LIMIT)
+				length =
+				    pv_count_records(start, length, line_end,
+						     &records);
+			for (idx = length - 1; idx >= 0; idx--) {
+				if (line_end == start[idx])
+					break;
+			}
+			if (idx >= 0) {
+				length = idx + 1;
+			} else if ((line_limit != PV_THREAD_NO_LIMIT)
+				   && (!reader_done)
+				   && (whole == available)
+				   && (available < state->buffer_size)) {
+				pv__thread_sleep(threads, events,
+						 TRANSFER_READ_TIMEOUT);
+				continue;
+			}
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		nwritten = write(STDOUT_FILENO, start, length);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (nwritten > 0) {
+			if (state->linemode) {
+				lines_total +=
+				    pv_count_byte(start, nwritten, line_end);
+				__atomic_store_n(&(threads->lines_total),
+						 lines_total,
+						 __ATOMIC_RELEASE);
+			}
+			if ((state->components_used & PV_DISPLAY_OUTPUTBUF)
+			    != 0)
+				pv__thread_lastoutput(threads, start,
+						      nwritten);
+			write_total += nwritten;
+			__atomic_store_n(&(threads->write_total),
+					 write_total, __ATOMIC_RELEASE);
+			pv__thread_wake(threads);
+			continue;
+		}
+
+		if (0 == nwritten)
+			break;
+
+		if ((EINTR == errno) || (EAGAIN == errno)) {
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 10000;
+			select(0, NULL, NULL, NULL, &tv);
+			continue;
+		}
+
+		/*
+		 * EPIPE means we've finished, and isn't our error to
+		 * report; anything else is left for the main thread to
+		 * report.
+		 */
+		if (EPIPE != errno) {
+			threads->output_errno = errno;
+			__atomic_store_n(&(threads->output_failed), 1,
+					 __ATOMIC_RELEASE);
+		}
+		break;
+	}
+
+	/*
+	 * Once we've stopped writing, the reader has nothing left to do.
+	 */
+	__atomic_store_n(&(threads->stop), 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(threads->writer_done), 1, __ATOMIC_RELEASE);
+	pv__thread_wake(threads);
+
+	return NULL;
+}
+
+
+/*
+ * In the main thread, pass on what the reader has read since the last
+ * call to pv_file_advise(), and deal with any request from the reader -
+ * reporting and maybe skipping past a read error, or moving on to the
+ * next input file - so that only the main thread ever changes the rest of
+ * the state.
+ */
+static void pv__thread_service(pvstate_t state,
+			       struct pvthreads_s *threads)
+{
+	unsigned long long read_total;
+	long reply;
+	int request, fd;
+
+	read_total =
+	    __atomic_load_n(&(threads->read_total), __ATOMIC_ACQUIRE);
+	if (read_total > threads->advised_total) {
+		pv_file_advise(state, threads->fd,
+			       read_total - threads->advised_total);
+		threads->advised_total = read_total;
+	}
+
+	request = __atomic_load_n(&(threads->request), __ATOMIC_ACQUIRE);
+	if (0 == request)
+		return;
+
+	reply = -1;
+
+	switch (request) {
+	case PV_THREAD_READ_ERROR:
+		state->read_errors_in_a_row = threads->request_errors - 1;
+		errno = threads->request_errno;
+		reply =
+		    pv_transfer_read_error(state, threads->fd,
+					   threads->request_length);
+		break;
+	case PV_THREAD_NEXT_FILE:
+		if (threads->filenum >= state->input_file_count - 1)
+			break;
+		threads->filenum++;
+		fd = pv_next_file(state, threads->filenum, threads->fd);
+		threads->fd = fd;
+		if (fd < 0) {
+			__atomic_store_n(&(threads->input_failed), 1,
+					 __ATOMIC_RELEASE);
+			break;
+		}
+		state->last_read_skip_fd = fd;
+		state->read_errors_in_a_row = 0;
+		state->read_error_warning_shown = 0;
+		reply = 0;
+		break;
+	default:
+		break;
+	}
+
+	threads->reply = reply;
+	__atomic_store_n(&(threads->request), 0, __ATOMIC_RELEASE);
+	pv__thread_wake(threads);
+}
+#endif				/* HAVE_LIBPTHREAD */
+
+
+/*
+ * Start the reader and writer threads, with the reader starting on the
+ * first input file, which has already been opened as "fd".  On success,
+ * the threads take ownership of "fd" and zero is returned; otherwise
+ * nonzero is returned and the caller should carry on with pv_transfer()
+ * instead.
+ */
+int pv_thread_start(pvstate_t state, int fd)
+{
+#ifdef HAVE_LIBPTHREAD
+	struct pvthreads_s *threads;
+	pthread_condattr_t condattr;
+	sigset_t allsigs, oldsigs;
+
+	if (NULL == state->transfer_buffer) {
+		state->buffer_size = state->target_buffer_size;
+		state->transfer_buffer =
+		    pv_transfer_buffer_alloc(state, state->buffer_size);
+		if (NULL == state->transfer_buffer) {
+			debug("%s: %s", "buffer allocation failed",
+			      strerror(errno));
+			return 1;
+		}
+	}
+
+	threads = calloc(1, sizeof(*threads));
+	if (NULL == threads)
+		return 1;
+
+	/*
+	 * Time out sleeps by the monotonic clock if we can, so that they
+	 * are not stretched or cut short by changes to the system clock.
+	 */
+	pthread_mutex_init(&(threads->lock), NULL);
+	pthread_condattr_init(&condattr);
+	threads->clock = CLOCK_REALTIME;
+#ifdef CLOCK_MONOTONIC
+	if (0 == pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC))
+		threads->clock = CLOCK_MONOTONIC;
+#endif				/* CLOCK_MONOTONIC */
+	pthread_cond_init(&(threads->cond), &condattr);
+	pthread_condattr_destroy(&condattr);
+	threads->write_limit = PV_THREAD_NO_LIMIT;
+	threads->line_limit = PV_THREAD_NO_LIMIT;
+	threads->fd = fd;
+
+	state->last_read_skip_fd = fd;
+	state->read_errors_in_a_row = 0;
+	state->read_error_warning_shown = 0;
+
+	state->threads = threads;
+	state->read_position = 0;
+	state->write_position = 0;
+
+	/*
+	 * Block all signals in the new threads, so that they are all
+	 * handled by the main thread as before.
+	 */
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+
+	if (0 ==
+	    pthread_create(&(threads->writer), NULL, pv__thread_writer,
+			   state))
+		threads->writer_started = 1;
+	if (threads->writer_started
+	    && (0 ==
+		pthread_create(&(threads->reader), NULL, pv__thread_reader,
+			       state)))
+		threads->reader_started = 1;
+
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	if (!threads->reader_started) {
+		debug("%s", "failed to start threads - disabling");
+		threads->fd = -1;
+		pv_thread_fini(state);
+		return 1;
+	}
+
+	return 0;
+#else				/* !HAVE_LIBPTHREAD */
+	return 1;
+#endif				/* HAVE_LIBPTHREAD */
+}
+
+
+/*
+ * Publish the write limit and report on what the threads have done since
+ * the last call, waiting up to 9/100 of a second for something to happen.
+ * Takes the same parameters and returns the same values as pv_transfer(),
+ * except that *eof_in and *eof_out are only set once all input files have
+ * been read and written.
+ */
+long pv_thread_transfer(pvstate_t state, int *eof_in, int *eof_out,
+			unsigned long long allowed, long *lineswritten)
+{
+#ifdef HAVE_LIBPTHREAD
+	struct pvthreads_s *threads;
+	unsigned long long limit, line_limit, write_total, read_total;
+	unsigned long long lines_total;
+	unsigned long events;
+	int done;
+	long written;
+
+	threads = state->threads;
+
+	if ((state->linemode) && (lineswritten != NULL))
+		*lineswritten = 0;
+
+	if ((*eof_in) && (*eof_out))
+		return 0;
+
+	/*
+	 * Let the writer go up to "allowed" bytes, or lines in line mode,
+	 * beyond what we have accounted for so far, if there is a limit.
+	 */
+	limit = PV_THREAD_NO_LIMIT;
+	line_limit = PV_THREAD_NO_LIMIT;
+	if ((state->rate_limit > 0) || (allowed > 0)) {
+		if (state->linemode) {
+			line_limit = threads->reported_lines + allowed;
+		} else {
+			limit = threads->reported_total + allowed;
+		}
+	}
+	if ((limit !=
+	     __atomic_load_n(&(threads->write_limit), __ATOMIC_ACQUIRE))
+	    || (line_limit !=
+		__atomic_load_n(&(threads->line_limit), __ATOMIC_ACQUIRE))) {
+		__atomic_store_n(&(threads->write_limit), limit,
+				 __ATOMIC_RELEASE);
+		__atomic_store_n(&(threads->line_limit), line_limit,
+				 __ATOMIC_RELEASE);
+		pv__thread_wake(threads);
+	}
+
+	events = pv__thread_events(threads);
+	if ((__atomic_load_n(&(threads->write_total), __ATOMIC_ACQUIRE) ==
+	     threads->reported_total)
+	    && (!__atomic_load_n(&(threads->writer_done), __ATOMIC_ACQUIRE)))
+		pv__thread_sleep(threads, events, TRANSFER_READ_TIMEOUT);
+
+	pv__thread_service(state, threads);
+
+	done = __atomic_load_n(&(threads->writer_done), __ATOMIC_ACQUIRE);
+	write_total =
+	    __atomic_load_n(&(threads->write_total), __ATOMIC_ACQUIRE);
+	read_total =
+	    __atomic_load_n(&(threads->read_total), __ATOMIC_ACQUIRE);
+	lines_total =
+	    __atomic_load_n(&(threads->lines_total), __ATOMIC_ACQUIRE);
+
+	written = write_total - threads->reported_total;
+	threads->reported_total = write_total;
+	if ((state->linemode) && (lineswritten != NULL))
+		*lineswritten = lines_total - threads->reported_lines;
+	threads->reported_lines = lines_total;
+
+	/*
+	 * Let the display see how full the buffer is.
+	 */
+	state->read_position = read_total - write_total;
+	state->write_position = 0;
+
+	if ((written > 0)
+	    && ((state->components_used & PV_DISPLAY_OUTPUTBUF) != 0)) {
+		size_t length = 0;
+		if (state->lastoutput_length > 0)
+			length = state->lastoutput_length;
+		if (length > sizeof(threads->lastoutput))
+			length = sizeof(threads->lastoutput);
+		if (length > 0) {
+			pthread_mutex_lock(&(threads->lock));
+			memcpy(state->lastoutput_buffer,
+			       threads->lastoutput +
+			       sizeof(threads->lastoutput) - length,
+			       length);
+			pthread_mutex_unlock(&(threads->lock));
+		}
+	}
+
+	if (done) {
+		*eof_in = 1;
+		*eof_out = 1;
+		if (__atomic_load_n(&(threads->output_failed),
+				    __ATOMIC_ACQUIRE)) {
+			pv_error(state, "%s: %s", _("write failed"),
+				 strerror(threads->output_errno));
+			state->exit_status |= 16;
+			return -1;
+		}
+		if (__atomic_load_n(&(threads->input_failed),
+				    __ATOMIC_ACQUIRE))
+			return -1;
+	}
+
+	return written;
+#else				/* !HAVE_LIBPTHREAD */
+	*eof_in = 1;
+	*eof_out = 1;
+	return -1;
+#endif				/* HAVE_LIBPTHREAD */
+}
+
+
+/*
+ * Stop the reader and writer threads, if they are running, and free
+ * their shared state.
+ */
+void pv_thread_fini(pvstate_t state)
+{
+#ifdef HAVE_LIBPTHREAD
+	struct pvthreads_s *threads;
+
+	if (NULL == state)
+		return;
+
+	threads = state->threads;
+	if (NULL == threads)
+		return;
+
+	/*
+	 * Ask the threads to stop, and cancel them in case they are
+	 * blocked reading or writing, which is the only time they can be
+	 * cancelled.
+	 */
+	__atomic_store_n(&(threads->stop), 1, __ATOMIC_RELEASE);
+	pv__thread_wake(threads);
+
+	if (threads->reader_started) {
+		pthread_cancel(threads->reader);
+		pthread_join(threads->reader, NULL);
+	}
+	if (threads->writer_started) {
+		pthread_cancel(threads->writer);
+		pthread_join(threads->writer, NULL);
+	}
+
+	if (threads->fd > 0)
+		close(threads->fd);
+
+	pthread_cond_destroy(&(threads->cond));
+	pthread_mutex_destroy(&(threads->lock));
+	free(threads);
+	state->threads = NULL;
+#endif				/* HAVE_LIBPTHREAD */
+}
+
+/* EOF */
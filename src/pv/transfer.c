@@ -15,48 +15,165 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#if defined(HAVE_SPLICE) && defined(HAVE_SENDFILE) \
+    && defined(HAVE_SYS_SENDFILE_H)
+#define PV_USE_SENDFILE 1
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif				/* HAVE_LINUX_IO_URING_H */
 
 
 /*
- * Read up to "count" bytes from file descriptor "fd" into the buffer "buf",
- * and return the number of bytes read, like read().
+ * A flush of the output to disk in progress, for --flush.  The thread
+ * only ever touches this structure, so that it can be left behind if we
+ * exit before it has finished.
+ */
+struct pvflush_s {
+#ifdef HAVE_LIBPTHREAD
+	pthread_t thread;
+#endif
+	int done;			 /* set once fsync() has returned */
+	int error;			 /* errno if fsync() failed */
+};
+
+
+/*
+ * The transfer buffer is used as a ring: state->read_position and
+ * state->write_position only ever move forwards, until the buffer is
+ * emptied, and the offset in the buffer of any position is the position
+ * modulo the buffer size.
+ *
+ * Fill in "iov" with the one or two parts of the transfer buffer covered
+ * by the "length" bytes starting at ring position "position", returning
+ * the number of entries used.
+ */
+static int pv__transfer_ring_iov(pvstate_t state,
+				 unsigned long long position,
+				 unsigned long long length,
+				 struct iovec *iov)
+{
+	unsigned long long offset;
+
+	if (0 == length)
+		return 0;
+
+	offset = position % state->buffer_size;
+	iov[0].iov_base = state->transfer_buffer + offset;
+
+	if (offset + length <= state->buffer_size) {
+		iov[0].iov_len = length;
+		return 1;
+	}
+
+	iov[0].iov_len = state->buffer_size - offset;
+	iov[1].iov_base = state->transfer_buffer;
+	iov[1].iov_len = length - iov[0].iov_len;
+
+	return 2;
+}
+
+
+/*
+ * Copy the first "max" bytes' worth of the I/O vector "iov", which has
+ * "iovcnt" entries, into "capped", returning the number of entries used.
+ */
+static int pv__transfer_iov_cap(const struct iovec *iov, int iovcnt,
+				struct iovec *capped, size_t max)
+{
+	int count;
+
+	for (count = 0; (count < iovcnt) && (max > 0); count++) {
+		capped[count] = iov[count];
+		if (capped[count].iov_len > max)
+			capped[count].iov_len = max;
+		max -= capped[count].iov_len;
+	}
+
+	return count;
+}
+
+
+/*
+ * Move the start of the I/O vector "iov", which has *iovcnt entries, on
+ * by "count" bytes, returning the new start and updating *iovcnt.
+ */
+static struct iovec *pv__transfer_iov_advance(struct iovec *iov,
+					      int *iovcnt, size_t count)
+{
+	while ((*iovcnt > 0) && (count >= iov->iov_len)) {
+		count -= iov->iov_len;
+		iov++;
+		(*iovcnt)--;
+	}
+
+	if ((*iovcnt > 0) && (count > 0)) {
+		iov->iov_base = (char *) (iov->iov_base) + count;
+		iov->iov_len -= count;
+	}
+
+	return iov;
+}
+
+
+/*
+ * Read into the buffers described by the I/O vector "iov", which has
+ * "iovcnt" entries, from file descriptor "fd", and return the number of
+ * bytes read, like readv().
  *
- * Unlike read(), if we have read less than "count" bytes, we check to see
+ * Unlike readv(), if we have read less than was asked for, we check to see
  * if there's any more to read, and keep trying, to make sure we fill the
- * buffer as full as we can.
+ * buffers as full as we can.  No more than MAX_READ_AT_ONCE bytes are
+ * asked for by each readv().
  *
  * We stop retrying if the time elapsed since this function was entered
  * reaches TRANSFER_READ_TIMEOUT microseconds.
  */
-static ssize_t pv__transfer_read_repeated(int fd, void *buf, size_t count)
+static ssize_t pv__transfer_read_repeated(int fd, struct iovec *iov,
+					  int iovcnt)
 {
 	struct timeval start_time;
 	ssize_t total_read;
+	size_t count;
+	int idx;
 
-	gettimeofday(&start_time, NULL);
+	pv_monotonic_time(&start_time);
 
 	total_read = 0;
 
+	count = 0;
+	for (idx = 0; idx < iovcnt; idx++)
+		count += iov[idx].iov_len;
+
 	while (count > 0) {
+		struct iovec capped[2];
 		ssize_t nread;
 		struct timeval now;
 		long elapsed_usec;
 
 		nread =
-		    read(fd, buf,
-			 count >
-			 MAX_READ_AT_ONCE ? MAX_READ_AT_ONCE : count);
+		    readv(fd, capped,
+			  pv__transfer_iov_cap(iov, iovcnt, capped,
+					       MAX_READ_AT_ONCE));
 		if (nread < 0)
 			return nread;
 
 		total_read += nread;
-		buf += nread;
+		iov = pv__transfer_iov_advance(iov, &iovcnt, nread);
 		count -= nread;
 
 		if (0 == nread)
 			return total_read;
 
-		gettimeofday(&now, NULL);
+		pv_monotonic_time(&now);
 		elapsed_usec =
 		    1000000 * (now.tv_sec - start_time.tv_sec) +
 		    (now.tv_usec - start_time.tv_usec);
@@ -68,19 +185,17 @@ static ssize_t pv__transfer_read_repeated(int fd, void *buf, size_t count)
 		}
 
 		if (count > 0) {
-			fd_set readfds;
-			struct timeval tv;
+			struct pollfd pfd;
 
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
-			FD_ZERO(&readfds);
-			FD_SET(fd, &readfds);
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
 
 			debug("%s %d: %s (%ld %s, %ld %s)", "fd", fd,
 			      "trying another read after partial buffer fill",
 			      nread, "read", count, "remaining");
 
-			if (select(fd + 1, &readfds, NULL, NULL, &tv) < 1)
+			if (poll(&pfd, 1, 0) < 1)
 				break;
 		}
 	}
@@ -90,35 +205,44 @@ static ssize_t pv__transfer_read_repeated(int fd, void *buf, size_t count)
 
 
 /*
- * Write up to "count" bytes to file descriptor "fd" from the buffer "buf",
- * and return the number of bytes written, like write().
+ * Write the buffers described by the I/O vector "iov", which has "iovcnt"
+ * entries, to file descriptor "fd", and return the number of bytes
+ * written, like writev().
  *
- * Unlike write(), if we have written less than "count" bytes, we check to
+ * Unlike writev(), if we have written less than was asked for, we check to
  * see if we can write any more, and keep trying, to make sure we empty the
- * buffer as much as we can.
+ * buffers as much as we can.  No more than MAX_WRITE_AT_ONCE bytes are
+ * asked for by each writev().
  *
  * We stop retrying if the time elapsed since this function was entered
  * reaches TRANSFER_WRITE_TIMEOUT microseconds.
  */
-static ssize_t pv__transfer_write_repeated(int fd, void *buf, size_t count)
+static ssize_t pv__transfer_write_repeated(int fd, struct iovec *iov,
+					   int iovcnt)
 {
 	struct timeval start_time;
 	ssize_t total_written;
+	size_t count;
+	int idx;
 
-	gettimeofday(&start_time, NULL);
+	pv_monotonic_time(&start_time);
 
 	total_written = 0;
 
+	count = 0;
+	for (idx = 0; idx < iovcnt; idx++)
+		count += iov[idx].iov_len;
+
 	while (count > 0) {
+		struct iovec capped[2];
 		ssize_t nwritten;
 		struct timeval now;
 		long elapsed_usec;
-		size_t asked_to_write;
 
-		asked_to_write = count >
-		    MAX_WRITE_AT_ONCE ? MAX_WRITE_AT_ONCE : count;
-
-		nwritten = write(fd, buf, asked_to_write);
+		nwritten =
+		    writev(fd, capped,
+			   pv__transfer_iov_cap(iov, iovcnt, capped,
+						MAX_WRITE_AT_ONCE));
 		if (nwritten < 0) {
 			if ((EINTR == errno) || (EAGAIN == errno)) {
 				/*
@@ -136,13 +260,13 @@ static ssize_t pv__transfer_write_repeated(int fd, void *buf, size_t count)
 		}
 
 		total_written += nwritten;
-		buf += nwritten;
+		iov = pv__transfer_iov_advance(iov, &iovcnt, nwritten);
 		count -= nwritten;
 
 		if (0 == nwritten)
 			return total_written;
 
-		gettimeofday(&now, NULL);
+		pv_monotonic_time(&now);
 		elapsed_usec =
 		    1000000 * (now.tv_sec - start_time.tv_sec) +
 		    (now.tv_usec - start_time.tv_usec);
@@ -157,24 +281,24 @@ static ssize_t pv__transfer_write_repeated(int fd, void *buf, size_t count)
 		 * Running the select() here seems to make PV eat a lot of
 		 * CPU in some cases, so instead we just go round the loop
 		 * again and rely on our alarm() to interrupt us if we run
-		 * out of time - also on our gettimeofday() check.
+		 * out of time - also on our elapsed time check.
 		 */
 		if (count > 0) {
-			fd_set writefds;
-			struct timeval tv;
-
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
-			FD_ZERO(&writefds);
-			FD_SET(fd, &writefds);
-
 			debug("%s %d: %s (%ld %s, %ld %s)", "fd", fd,
 			      "trying another write after partial buffer flush",
 			      nwritten, "written", count, "remaining");
 
 # if 0					    /* disabled after 1.6.0 - see comment above */
-			if (select(fd + 1, NULL, &writefds, NULL, &tv) < 1)
-				break;
+			{
+				struct pollfd pfd;
+
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+
+				if (poll(&pfd, 1, 0) < 1)
+					break;
+			}
 # endif
 		}
 	}
@@ -183,146 +307,331 @@ static ssize_t pv__transfer_write_repeated(int fd, void *buf, size_t count)
 }
 
 
+#ifdef HAVE_LINUX_IO_URING_H
 /*
- * Read some data from the given file descriptor. Returns zero if there was
- * a transient error and we need to return 0 from pv_transfer, otherwise
- * returns 1.
- *
- * At most, the number of bytes read will be the number of bytes remaining
- * in the input buffer.  If state->rate_limit is >0, and/or "allowed" is >0,
- * then the maximum number of bytes read will be the number remaining unused
- * in the input buffer or the value of "allowed", whichever is smaller.
- *
- * If splice() was successfully used, sets state->splice_used to 1; if it
- * failed, then state->splice_failed_fd is updated to the current fd so
- * splice() won't be tried again until the next input file.
- *
- * Updates state->read_position by the number of bytes read, unless splice()
- * was used, in which case it does not since there's nothing in the buffer
- * (and it also adds the bytes to state->written since they've been written
- * to the output).
- *
- * On read error, updates state->exit_status, and if allowed by
- * state->skip_errors, tries to skip past the problem.
- *
- * If the end of the input file is reached or the error is unrecoverable,
- * sets *eof_in to 1.  If all data in the buffer has been written at this
- * point, then also sets *eof_out.
+ * User data values identifying the write and timeout operations queued on
+ * the io_uring; reads are identified by a sequence number, which never
+ * gets this high.
  */
-static int pv__transfer_read(pvstate_t state, int fd,
-			     int *eof_in, int *eof_out,
-			     unsigned long long allowed,
-			     long *lineswritten)
+#define PV_URING_WRITE		(~0ULL)
+#define PV_URING_TIMEOUT	(~0ULL - 1)
+#define PV_URING_CANCEL		(~0ULL - 2)
+
+/*
+ * A read queued on the io_uring, of "length" bytes into the transfer buffer
+ * at ring position "position".
+ */
+struct pvuring_read_s {
+	unsigned long long id;		 /* sequence number (user data) */
+	unsigned long long position;	 /* where in the ring it goes */
+	unsigned long length;		 /* number of bytes asked for */
+	long long file_offset;		 /* input file offset, -1 if pipe */
+	long result;			 /* result, once complete */
+	unsigned char complete;		 /* set once the result arrives */
+	unsigned char discard;		 /* set if the result is unwanted */
+};
+
+/*
+ * State of the io_uring transfer engine.
+ */
+struct pvuring_s {
+	int ring_fd;			 /* io_uring file descriptor */
+	void *sq_ptr;			 /* mapped submission queue ring */
+	size_t sq_size;
+	void *cq_ptr;			 /* mapped completion queue ring */
+	size_t cq_size;
+	struct io_uring_sqe *sqes;	 /* mapped submission queue entries */
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct __kernel_timespec timeout; /* how long to wait each time */
+
+	int read_fd;			 /* input fd the reads are for */
+	long long read_offset;		 /* next offset to read, -1 if pipe */
+	unsigned long long next_id;	 /* next read sequence number */
+	int reads_queued;		 /* number of entries in reads[] */
+	struct pvuring_read_s reads[URING_MAX_READS];
+	unsigned char read_eof;		 /* set once a read returns 0 */
+	unsigned char read_failed;	 /* set once a read fails */
+	unsigned char write_inflight;	 /* set while a write is queued */
+	unsigned char timeout_inflight;	 /* set while a timeout is queued */
+};
+
+
+/*
+ * Unmap and close the given io_uring, and free its state.
+ */
+static void pv__uring_free(struct pvuring_s *ring)
 {
-	unsigned long bytes_can_read;
-	unsigned long amount_to_skip;
-	long amount_skipped;
-	long orig_offset;
-	long skip_offset;
-	ssize_t nread;
-#ifdef HAVE_SPLICE
-	size_t bytes_to_splice;
-#endif				/* HAVE_SPLICE */
+	if (NULL == ring)
+		return;
+	if (NULL != ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if ((NULL != ring->cq_ptr) && (ring->cq_ptr != ring->sq_ptr))
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (NULL != ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->ring_fd >= 0)
+		close(ring->ring_fd);
+	free(ring);
+}
 
-	bytes_can_read = state->buffer_size - state->read_position;
 
-#ifdef HAVE_SPLICE
-	state->splice_used = 0;
-	if ((!state->linemode) && (!state->no_splice)
-	    && (fd != state->splice_failed_fd)
-	    && (0 == state->to_write)) {
-		if (state->rate_limit || allowed != 0)
-			bytes_to_splice = allowed;
-		else
-			bytes_to_splice = bytes_can_read;
+/*
+ * Set up an io_uring for the transfer engine in state->uring, returning
+ * nonzero on failure.
+ */
+static int pv__uring_setup(pvstate_t state)
+{
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_RW_CUR_POS)
+	struct io_uring_params params;
+	struct pvuring_s *ring;
+	void *ptr;
 
-		nread = splice(fd, NULL, STDOUT_FILENO, NULL,
-			       bytes_to_splice, SPLICE_F_MORE);
+	ring = calloc(1, sizeof(*ring));
+	if (NULL == ring)
+		return 1;
 
-		state->splice_used = 1;
-		if ((nread < 0) && (EINVAL == errno)) {
-			debug("%s %d: %s", "fd", fd,
-			      "splice failed with EINVAL - disabling");
-			state->splice_failed_fd = fd;
-			state->splice_used = 0;
-			/*
-			 * Fall through to read() below.
-			 */
-		} else if (nread > 0) {
-			state->written = nread;
-		} else if ((-1 == nread) && (EAGAIN == errno)) {
-			/* nothing read yet - do nothing */
-		} else {
-			/* EOF might not really be EOF, it seems */
-			state->splice_used = 0;
-		}
+	memset(&params, 0, sizeof(params));
+	ring->ring_fd =
+	    syscall(__NR_io_uring_setup, URING_MAX_READS + 4, &params);
+	if (ring->ring_fd < 0) {
+		debug("%s: %s", "io_uring_setup", strerror(errno));
+		free(ring);
+		return 1;
 	}
-	if (0 == state->splice_used) {
-		nread =
-		    pv__transfer_read_repeated(fd,
-					       state->transfer_buffer +
-					       state->read_position,
-					       bytes_can_read);
+
+	/*
+	 * We need to be able to read from pipes and write to stdout at the
+	 * current file position, by passing an offset of -1.
+	 */
+	if (0 == (params.features & IORING_FEAT_RW_CUR_POS)) {
+		debug("%s", "io_uring lacks IORING_FEAT_RW_CUR_POS");
+		pv__uring_free(ring);
+		return 1;
 	}
-#else
-	nread =
-	    pv__transfer_read_repeated(fd,
-				       state->transfer_buffer +
-				       state->read_position,
-				       bytes_can_read);
-#endif				/* HAVE_SPLICE */
 
+	ring->sq_size =
+	    params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_size =
+	    params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
 
-	if (0 == nread) {
-		/*
-		 * If read returned 0, we've reached the end of this input
-		 * file.  If we've also written all the data in the transfer
-		 * buffer, we set eof_out as well, so that the main loop can
-		 * move on to the next input file.
-		 */
-		*eof_in = 1;
-		if (state->write_position >= state->read_position)
-			*eof_out = 1;
+	ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+		   IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ptr) {
+		debug("%s: %s", "io_uring SQ mmap", strerror(errno));
+		pv__uring_free(ring);
 		return 1;
-	} else if (nread > 0) {
-		/*
-		 * Read returned >0, so we successfully read data - clear
-		 * the error counter and update our record of how much data
-		 * we've got in the buffer.
-		 */
-		state->read_errors_in_a_row = 0;
-#ifdef HAVE_SPLICE
-		/*
-		 * If we used splice(), there isn't any more data in the
-		 * buffer than there was before.
-		 */
-		if (0 == state->splice_used)
-			state->read_position += nread;
-#else
-		state->read_position += nread;
-#endif				/* HAVE_SPLICE */
+	}
+	ring->sq_ptr = ptr;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ptr) {
+			debug("%s: %s", "io_uring CQ mmap",
+			      strerror(errno));
+			pv__uring_free(ring);
+			return 1;
+		}
+		ring->cq_ptr = ptr;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+		   IORING_OFF_SQES);
+	if (MAP_FAILED == ptr) {
+		debug("%s: %s", "io_uring SQE mmap", strerror(errno));
+		pv__uring_free(ring);
 		return 1;
 	}
+	ring->sqes = ptr;
+
+	ring->sq_head = ring->sq_ptr + params.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + params.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + params.sq_off.array;
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = ring->cq_ptr + params.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + params.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + params.cq_off.cqes;
+
+	ring->timeout.tv_sec = 0;
+	ring->timeout.tv_nsec = TRANSFER_READ_TIMEOUT * 1000;
+	ring->read_fd = -1;
+	ring->read_offset = -1;
+
+	state->uring = ring;
+
+	return 0;
+#else				/* no usable io_uring definitions */
+	return 1;
+#endif
+}
 
-	/*
-	 * If we reach this point, nread<0, so there was an error.
-	 */
 
-	/*
-	 * If a read error occurred but it was EINTR or EAGAIN, just wait a
-	 * bit and then return zero, since this was a transient error.
-	 */
-	if ((EINTR == errno) || (EAGAIN == errno)) {
-		struct timeval tv;
-		debug("%s %d: %s: %s", "fd", fd,
-		      "transient error - waiting briefly",
-		      strerror(errno));
-		tv.tv_sec = 0;
-		tv.tv_usec = 10000;
-		select(0, NULL, NULL, NULL, &tv);
-		return 0;
+/*
+ * Queue an operation on the io_uring, returning nonzero if the submission
+ * queue is full.
+ */
+static int pv__uring_queue(struct pvuring_s *ring, unsigned char opcode,
+			   int fd, void *addr, unsigned int len,
+			   unsigned long long offset,
+			   unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail, idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *(ring->sq_tail);
+	if (tail - head >= ring->sq_entries)
+		return 1;
+
+	idx = tail & *(ring->sq_mask);
+	sqe = &(ring->sqes[idx]);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/*
+ * Submit everything queued on the io_uring and wait for at least
+ * "min_complete" completions, returning like io_uring_enter().
+ */
+static int pv__uring_enter(struct pvuring_s *ring, unsigned int min_complete)
+{
+	unsigned int to_submit;
+
+	to_submit = *(ring->sq_tail) -
+	    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return syscall(__NR_io_uring_enter, ring->ring_fd, to_submit,
+		       min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+
+/*
+ * Collect all available completions from the io_uring, recording read
+ * results in ring->reads[] and clearing the in-flight flags of the write
+ * and timeout.  Returns the result of the write if it completed, storing 1
+ * in *write_done, otherwise stores 0 in *write_done.
+ */
+static int pv__uring_reap(struct pvuring_s *ring, int *write_done)
+{
+	unsigned int head, tail;
+	int write_result = 0;
+	int i;
+
+	*write_done = 0;
+
+	head = *(ring->cq_head);
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe;
+
+		cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+		head++;
+
+		if (PV_URING_WRITE == cqe->user_data) {
+			ring->write_inflight = 0;
+			write_result = cqe->res;
+			*write_done = 1;
+			continue;
+		} else if (PV_URING_TIMEOUT == cqe->user_data) {
+			ring->timeout_inflight = 0;
+			continue;
+		} else if (PV_URING_CANCEL == cqe->user_data) {
+			continue;
+		}
+
+		for (i = 0; i < ring->reads_queued; i++) {
+			if (ring->reads[i].id != cqe->user_data)
+				continue;
+			ring->reads[i].result = cqe->res;
+			ring->reads[i].complete = 1;
+			break;
+		}
 	}
 
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return write_result;
+}
+
+
+/*
+ * Return nonzero if the io_uring engine has operations in flight that use
+ * the transfer buffer, in which case the buffer must not be moved around.
+ */
+static int pv__transfer_uring_busy(pvstate_t state)
+{
+	if (NULL == state->uring)
+		return 0;
+	if (state->uring->reads_queued > 0)
+		return 1;
+	if (state->uring->write_inflight)
+		return 1;
+	return 0;
+}
+
+#else				/* !HAVE_LINUX_IO_URING_H */
+
+static int pv__transfer_uring_busy(pvstate_t state)
+{
+	return 0;
+}
+
+#endif				/* HAVE_LINUX_IO_URING_H */
+
+
+/*
+ * Handle a read error, described by errno, that is not transient, while
+ * reading "fd".  Updates state->exit_status, and if allowed by
+ * state->skip_errors, tries to seek past the problem by at most
+ * "bytes_can_read" bytes.
+ *
+ * Returns the number of bytes skipped, which the caller should treat as
+ * having been read as zero bytes, or 0 if the error could not be skipped
+ * and the file should be treated as having ended.
+ */
+long pv_transfer_read_error(pvstate_t state, int fd,
+			    unsigned long bytes_can_read)
+{
+	unsigned long amount_to_skip;
+	long amount_skipped;
+	long orig_offset;
+	long skip_offset;
+
 	/*
 	 * The read error is not transient, so update the program's final
 	 * exit status, regardless of whether we're skipping errors, and
@@ -339,11 +648,7 @@ static int pv__transfer_read(pvstate_t state, int fd,
 		pv_error(state, "%s: %s: %s",
 			 state->current_file,
 			 _("read failed"), strerror(errno));
-		*eof_in = 1;
-		if (state->write_position >= state->read_position) {
-			*eof_out = 1;
-		}
-		return 1;
+		return 0;
 	}
 
 	/*
@@ -372,11 +677,7 @@ static int pv__transfer_read(pvstate_t state, int fd,
 		pv_error(state, "%s: %s: %s",
 			 state->current_file,
 			 _("file is not seekable"), strerror(errno));
-		*eof_in = 1;
-		if (state->write_position >= state->read_position) {
-			*eof_out = 1;
-		}
-		return 1;
+		return 0;
 	}
 
 	if (state->read_errors_in_a_row < 10) {
@@ -420,11 +721,9 @@ static int pv__transfer_read(pvstate_t state, int fd,
 
 	if (skip_offset < 0) {
 		/*
-		 * Failed to skip - lseek() returned an error, so mark the
-		 * file as having ended.
-		 */
-		*eof_in = 1;
-		/*
+		 * Failed to skip - lseek() returned an error, so the file
+		 * will be treated as having ended.
+		 *
 		 * EINVAL means the file has ended since we've tried to go
 		 * past the end of it, so we don't bother with a warning
 		 * since it just means we've reached the end anyway.
@@ -442,25 +741,1490 @@ static int pv__transfer_read(pvstate_t state, int fd,
 	}
 
 	/*
-	 * If we succeeded in skipping some bytes, zero the equivalent part
-	 * of the transfer buffer, and update the buffer position.
+	 * If we failed to skip, the file is treated as having ended.
+	 */
+	if (amount_skipped <= 0)
+		return 0;
+
+	if (state->skip_errors < 2) {
+		pv_error(state, "%s: %s: %ld - %ld (%ld %s)",
+			 state->current_file,
+			 _("skipped past read error"),
+			 orig_offset, skip_offset, amount_skipped, _("B"));
+	}
+
+	return amount_skipped;
+}
+
+
+#ifdef HAVE_SPLICE
+/*
+ * Ways of copying data from the input straight to the output without
+ * passing it through the transfer buffer.
+ */
+#define PV_COPY_SPLICE		0	 /* splice(), needs a pipe at one end */
+#define PV_COPY_FILE_RANGE	1	 /* copy_file_range(), file to file */
+#define PV_COPY_SENDFILE	2	 /* sendfile(), file to socket */
+#define PV_COPY_PIPE		3	 /* splice() via an internal pipe */
+
+
+/*
+ * Splice up to "count" bytes from "fd" into our internal pipe, and from
+ * there to standard output, returning the number of bytes that reached
+ * standard output, or -1 with errno set.
+ *
+ * Data can be left in the pipe between calls (state->splice_pipe_fill
+ * bytes), so 0 and most errors are only returned once the pipe is empty;
+ * until then, a failure to read just means that what is in the pipe is
+ * written out.  If writing from the pipe fails, anything still in it is
+ * read into the transfer buffer - which is always empty when this is
+ * called - so that nothing is lost or reordered if the caller falls back
+ * to read() and write().
+ */
+static ssize_t pv__transfer_splice_pipe(pvstate_t state, int fd,
+					size_t count)
+{
+	ssize_t nread, nwritten;
+	struct iovec iov[2];
+	int iovcnt, saved_errno;
+
+	if (state->splice_pipe_fill < count) {
+		nread =
+		    splice(fd, NULL, state->splice_pipe_fd[1], NULL,
+			   count - state->splice_pipe_fill,
+			   SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+		if (nread > 0) {
+			state->splice_pipe_fill += nread;
+		} else if (0 == state->splice_pipe_fill) {
+			return nread;
+		}
+	}
+
+	if (0 == state->splice_pipe_fill)
+		return 0;
+
+	if (0 == count) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	nwritten =
+	    splice(state->splice_pipe_fd[0], NULL, STDOUT_FILENO, NULL,
+		   state->splice_pipe_fill <
+		   count ? state->splice_pipe_fill : count, SPLICE_F_MORE);
+
+	if (nwritten > 0) {
+		state->splice_pipe_fill -= nwritten;
+		return nwritten;
+	}
+
+	if ((nwritten < 0) && ((EAGAIN == errno) || (EINTR == errno))) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/*
+	 * Writing failed, so move what is in the pipe into the transfer
+	 * buffer and report the error, so that the caller falls back to
+	 * write().
+	 */
+	saved_errno = (nwritten < 0) ? errno : EINVAL;
+
+	iovcnt =
+	    pv__transfer_ring_iov(state, state->read_position,
+				  state->splice_pipe_fill, iov);
+	nread =
+	    pv__transfer_read_repeated(state->splice_pipe_fd[0], iov,
+				       iovcnt);
+	if (nread > 0)
+		state->read_position += nread;
+	state->splice_pipe_fill = 0;
+
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * Copy up to "count" bytes from "fd" straight to standard output, using
+ * whichever system call suits the types of the two files, and return what
+ * it returned.
+ *
+ * Between two regular files, copy_file_range() lets the filesystem share
+ * or copy the data itself, and from a regular file to a socket, sendfile()
+ * avoids copying the data through user space; otherwise splice() is used,
+ * which only works if one end is a pipe - unless --splice-pipe was given,
+ * in which case, if neither end is a pipe, data is spliced through an
+ * internal pipe instead.  The choice is made again for each new input
+ * file.
+ */
+static ssize_t pv__transfer_kernel_copy(pvstate_t state, int fd,
+					size_t count)
+{
+	if (fd != state->splice_checked_fd) {
+		struct stat64 isb, osb;
+		int known;
+
+		state->splice_checked_fd = fd;
+		state->splice_method = PV_COPY_SPLICE;
+
+		known = ((0 == fstat64(fd, &isb))
+			 && (0 == fstat64(STDOUT_FILENO, &osb))) ? 1 : 0;
+
+		if (known && S_ISREG(isb.st_mode)) {
+#ifdef HAVE_COPY_FILE_RANGE
+			if (S_ISREG(osb.st_mode))
+				state->splice_method = PV_COPY_FILE_RANGE;
+#endif				/* HAVE_COPY_FILE_RANGE */
+#ifdef PV_USE_SENDFILE
+			if (S_ISSOCK(osb.st_mode))
+				state->splice_method = PV_COPY_SENDFILE;
+#endif				/* PV_USE_SENDFILE */
+		}
+
+		if (known && (state->splice_pipe)
+		    && (PV_COPY_SPLICE == state->splice_method)
+		    && (!S_ISFIFO(isb.st_mode))
+		    && (!S_ISFIFO(osb.st_mode))) {
+			if (state->splice_pipe_fd[0] < 0) {
+				if (pipe(state->splice_pipe_fd) != 0) {
+					debug("%s: %s", "pipe",
+					      strerror(errno));
+					state->splice_pipe_fd[0] = -1;
+					state->splice_pipe_fd[1] = -1;
+				}
+#ifdef F_SETPIPE_SZ
+				else {
+					fcntl(state->splice_pipe_fd[1],
+					      F_SETPIPE_SZ,
+					      (int) (state->buffer_size));
+				}
+#endif				/* F_SETPIPE_SZ */
+			}
+			if (state->splice_pipe_fd[0] >= 0)
+				state->splice_method = PV_COPY_PIPE;
+		}
+
+		debug("%s %d: %s: %d", "fd", fd, "kernel copy method",
+		      state->splice_method);
+	}
+
+	switch (state->splice_method) {
+#ifdef HAVE_COPY_FILE_RANGE
+	case PV_COPY_FILE_RANGE:
+		return copy_file_range(fd, NULL, STDOUT_FILENO, NULL, count,
+				       0);
+#endif				/* HAVE_COPY_FILE_RANGE */
+#ifdef PV_USE_SENDFILE
+	case PV_COPY_SENDFILE:
+		return sendfile(STDOUT_FILENO, fd, NULL, count);
+#endif				/* PV_USE_SENDFILE */
+	case PV_COPY_PIPE:
+		return pv__transfer_splice_pipe(state, fd, count);
+	default:
+		break;
+	}
+
+	return splice(fd, NULL, STDOUT_FILENO, NULL, count, SPLICE_F_MORE);
+}
+#endif				/* HAVE_SPLICE */
+
+
+/*
+ * Turn O_DIRECT on (if "on" is nonzero) or off for the given file
+ * descriptor, returning nonzero on error.
+ */
+int pv_transfer_direct_set(int fd, int on)
+{
+#ifdef O_DIRECT
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return 1;
+	if (on) {
+		flags |= O_DIRECT;
+	} else {
+		flags &= ~O_DIRECT;
+	}
+	if (fcntl(fd, F_SETFL, flags) != 0) {
+		debug("%s %d: %s: %s", "fd", fd, "failed to change O_DIRECT",
+		      strerror(errno));
+		return 1;
+	}
+	return 0;
+#else				/* !O_DIRECT */
+	return 1;
+#endif				/* O_DIRECT */
+}
+
+
+/*
+ * With --direct-io, turn on O_DIRECT for standard output if it is a
+ * regular file or block device, unless we are in line mode, where output
+ * has to end on a line boundary rather than a block boundary.
+ */
+void pv_transfer_direct_output(pvstate_t state)
+{
+	struct stat64 sb;
+
+	if ((!state->direct_io) || (state->linemode))
+		return;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return;
+	if ((!S_ISREG(sb.st_mode)) && (!S_ISBLK(sb.st_mode)))
+		return;
+	if (0 == pv_transfer_direct_set(STDOUT_FILENO, 1))
+		state->direct_output = 1;
+}
+
+
+#ifdef F_SETPIPE_SZ
+/*
+ * Return the largest size an unprivileged process may give a pipe, from
+ * /proc/sys/fs/pipe-max-size, or 0 if it cannot be read.
+ */
+static long pv__transfer_pipe_max(void)
+{
+	FILE *fptr;
+	long max;
+
+	fptr = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (NULL == fptr)
+		return 0;
+	if (1 != fscanf(fptr, "%ld", &max))
+		max = 0;
+	fclose(fptr);
+
+	return max;
+}
+#endif				/* F_SETPIPE_SZ */
+
+
+/*
+ * If "fd" is a pipe, make it big enough to hold the size given with
+ * --pipe-size or, by default, as much as we read or write in one go (or
+ * the whole transfer buffer, if that is bigger), up to the most the system
+ * allows.  A pipe's default capacity is far less than this, so without
+ * it, each read or write would move only a fraction of what it could and
+ * we would wait on the other end of the pipe far more often.
+ *
+ * Pipes are never made smaller, and failure is not an error - the pipe is
+ * just left as it was.
+ */
+void pv_transfer_pipe_resize(pvstate_t state, int fd)
+{
+#ifdef F_SETPIPE_SZ
+	struct stat64 sb;
+	unsigned long long wanted;
+	long current, target, max, achieved;
+
+	if ((0 != fstat64(fd, &sb)) || (!S_ISFIFO(sb.st_mode)))
+		return;
+
+	max = pv__transfer_pipe_max();
+
+	if (state->pipe_size > 0) {
+		wanted = state->pipe_size;
+	} else {
+		if (max <= 0)
+			return;
+		wanted = state->target_buffer_size;
+		if (wanted < MAX_READ_AT_ONCE)
+			wanted = MAX_READ_AT_ONCE;
+		if (wanted > (unsigned long long) max)
+			wanted = max;
+	}
+
+	/*
+	 * The size is passed as an int, and the kernel rounds it up to a
+	 * power of two, so don't ask for more than 1GiB.
+	 */
+	if (wanted > PIPE_SIZE_MAX)
+		wanted = PIPE_SIZE_MAX;
+	target = (long) wanted;
+
+	current = fcntl(fd, F_GETPIPE_SZ);
+	if ((current < 0) || (current >= target))
+		return;
+
+	achieved = fcntl(fd, F_SETPIPE_SZ, (int) target);
+
+	/*
+	 * Asking for more than pipe-max-size needs privileges, so if that
+	 * was refused, settle for the maximum.
+	 */
+	if ((achieved < 0) && (EPERM == errno) && (max > current)
+	    && (max < target))
+		achieved = fcntl(fd, F_SETPIPE_SZ, (int) max);
+
+	if (achieved < 0) {
+		debug("%s %d: %s: %s", "fd", fd, "failed to resize pipe",
+		      strerror(errno));
+		return;
+	}
+
+	debug("%s %d: %s: %ld -> %ld", "fd", fd, "pipe size", current,
+	      achieved);
+#endif				/* F_SETPIPE_SZ */
+}
+
+
+/*
+ * Return the offset in standard output that the next write will go to, or
+ * -1 if it is not seekable.
+ */
+static long long pv__transfer_output_offset(void)
+{
+	int flags;
+
+	/*
+	 * When appending, output goes at the end of the file, wherever the
+	 * file position happens to be.
+	 */
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if ((flags >= 0) && (flags & O_APPEND))
+		return lseek64(STDOUT_FILENO, 0, SEEK_END);
+
+	return lseek64(STDOUT_FILENO, 0, SEEK_CUR);
+}
+
+
+/*
+ * If the total size of the input is known and standard output is a
+ * regular file, allocate disk space for all of the output before the
+ * transfer starts, so that the filesystem can lay it out in one go rather
+ * than a piece at a time, and so that we find out straight away if there
+ * isn't enough room.  The file size is left alone.
+ *
+ * Returns nonzero, having reported the error, if there isn't enough room.
+ */
+int pv_transfer_preallocate(pvstate_t state)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	struct stat64 sb;
+	long long offset;
+
+	if ((state->prealloc_size < 1) || (state->sparse_output))
+		return 0;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return 0;
+	if (!S_ISREG(sb.st_mode))
+		return 0;
+
+	offset = pv__transfer_output_offset();
+	if (offset < 0)
+		return 0;
+
+	if (0 ==
+	    fallocate(STDOUT_FILENO, FALLOC_FL_KEEP_SIZE, (off_t) offset,
+		      (off_t) (state->prealloc_size))) {
+		state->prealloc_end = offset + state->prealloc_size;
+		return 0;
+	}
+
+	if ((ENOSPC == errno) || (EDQUOT == errno) || (EFBIG == errno)) {
+		pv_error(state, "%s: %s",
+			 _("failed to allocate space for output"),
+			 strerror(errno));
+		state->exit_status |= 16;
+		return 1;
+	}
+
+	/*
+	 * Anything else, such as the filesystem not supporting it, just
+	 * means we carry on without.
+	 */
+	debug("%s: %s", "fallocate", strerror(errno));
+#endif				/* HAVE_FALLOCATE && FALLOC_FL_KEEP_SIZE */
+	return 0;
+}
+
+
+/*
+ * Release any space allocated by pv_transfer_preallocate() beyond the end
+ * of the output, such as if the input turned out to be shorter than it
+ * was, or the transfer was cut short.
+ */
+static void pv__transfer_preallocate_trim(pvstate_t state)
+{
+	struct stat64 sb;
+
+	if (state->prealloc_end < 1)
+		return;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return;
+	if ((unsigned long long) (sb.st_size) < state->prealloc_end) {
+		if (0 != ftruncate(STDOUT_FILENO, sb.st_size))
+			debug("%s: %s", "ftruncate", strerror(errno));
+	}
+	state->prealloc_end = 0;
+}
+
+
+/*
+ * With --sparse, if standard output is a regular file which we are writing
+ * at or past the end of, so that anything we skip over will read back as
+ * zeroes, leave holes in it instead of writing zero blocks.
+ */
+void pv_transfer_sparse_init(pvstate_t state)
+{
+	struct stat64 sb;
+	long long offset;
+	int flags;
+
+	state->sparse_output = 0;
+
+	if ((!state->sparse) || (state->linemode) || (state->direct_io))
+		return;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return;
+	if (!S_ISREG(sb.st_mode))
+		return;
+
+	/*
+	 * Seeking makes no difference to where appended data goes.
+	 */
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if ((flags < 0) || (flags & O_APPEND))
+		return;
+
+	offset = lseek64(STDOUT_FILENO, 0, SEEK_CUR);
+	if ((offset < 0) || (offset < sb.st_size))
+		return;
+
+	state->sparse_out_offset = offset;
+	state->sparse_output = 1;
+}
+
+
+/*
+ * If the output ends in a hole, extend it to its full size, since skipping
+ * over the end with lseek() doesn't do that.
+ */
+void pv_transfer_sparse_finish(pvstate_t state)
+{
+	struct stat64 sb;
+
+	if (!state->sparse_output)
+		return;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return;
+	if ((unsigned long long) (sb.st_size) >= state->sparse_out_offset)
+		return;
+
+	if (0 != ftruncate(STDOUT_FILENO, (off_t) (state->sparse_out_offset))) {
+		pv_error(state, "%s: %s", _("failed to extend output"),
+			 strerror(errno));
+		state->exit_status |= 16;
+	}
+}
+
+
+/*
+ * Return the length of the run of blocks at the start of the data waiting
+ * to be written which are either all zero or all not, setting *zero to
+ * say which.  Blocks are SPARSE_BLOCK bytes, aligned to the output offset.
+ */
+static unsigned long pv__transfer_sparse_run(pvstate_t state, int *zero)
+{
+	unsigned long run, block;
+	struct iovec iov[2];
+	int iovcnt, idx, is_zero;
+
+	run = 0;
+	*zero = -1;
+
+	while (run < (unsigned long) (state->to_write)) {
+		block =
+		    SPARSE_BLOCK -
+		    ((state->sparse_out_offset + run) % SPARSE_BLOCK);
+		if (block > state->to_write - run)
+			block = state->to_write - run;
+
+		iovcnt =
+		    pv__transfer_ring_iov(state, state->write_position + run,
+					  block, iov);
+		is_zero = 1;
+		for (idx = 0; (idx < iovcnt) && (is_zero); idx++) {
+			is_zero =
+			    pv_zero_block(iov[idx].iov_base,
+					  iov[idx].iov_len);
+		}
+
+		if (*zero < 0) {
+			*zero = is_zero;
+		} else if (is_zero != *zero) {
+			break;
+		}
+
+		run += block;
+	}
+
+	return run;
+}
+
+
+#ifdef SEEK_DATA
+/*
+ * If the input file "fd" is in a hole at the moment, deal with the hole
+ * without reading it, and return 1; otherwise return 0, having made sure
+ * that state->sparse_next_hole is where the next hole starts.
+ *
+ * If the transfer buffer is empty and holes can be left in the output,
+ * the hole is skipped over in both; otherwise, up to "bytes_can_read"
+ * zeroes are put in the buffer.  Either way, no more than "allowed" bytes
+ * are dealt with if there is a rate limit.
+ */
+static int pv__transfer_sparse_read(pvstate_t state, int fd,
+				    unsigned long long allowed,
+				    unsigned long bytes_can_read)
+{
+	unsigned long long length;
+	long long offset, data, hole;
+	struct iovec iov[2];
+	int iovcnt, idx;
+
+	offset = state->sparse_in_offset;
+	if ((unsigned long long) offset < state->sparse_next_hole)
+		return 0;
+
+	data = lseek64(fd, offset, SEEK_DATA);
+	if ((data < 0) && (ENXIO == errno)) {
+		struct stat64 sb;
+		/*
+		 * No more data, so the rest of the file is a hole.
+		 */
+		if (0 == fstat64(fd, &sb))
+			data = sb.st_size;
+	}
+
+	if (data <= offset) {
+		hole = -1;
+		if (data == offset)
+			hole = lseek64(fd, offset, SEEK_HOLE);
+		lseek64(fd, offset, SEEK_SET);
+		if (hole <= offset) {
+			debug("%s %d: %s", "fd", fd,
+			      "cannot find holes - disabling sparse input");
+			state->sparse_input_fd = -1;
+			return 0;
+		}
+		state->sparse_next_hole = hole;
+		return 0;
+	}
+
+	length = data - offset;
+	if (((state->rate_limit > 0) || (allowed > 0))
+	    && (length > allowed))
+		length = allowed;
+
+	if ((state->sparse_output)
+	    && (state->read_position == state->write_position)
+	    && (length > 0)) {
+		if (lseek64(STDOUT_FILENO, length, SEEK_CUR) >= 0) {
+			state->sparse_out_offset += length;
+			state->written += length;
+		} else {
+			debug("%s: %s", "lseek", strerror(errno));
+			state->sparse_output = 0;
+			length = 0;
+		}
+	} else {
+		if (length > bytes_can_read)
+			length = bytes_can_read;
+		iovcnt =
+		    pv__transfer_ring_iov(state, state->read_position,
+					  length, iov);
+		for (idx = 0; idx < iovcnt; idx++)
+			memset(iov[idx].iov_base, 0, iov[idx].iov_len);
+		state->read_position += length;
+	}
+
+	state->sparse_in_offset += length;
+	lseek64(fd, state->sparse_in_offset, SEEK_SET);
+	pv_file_advise(state, fd, length);
+
+	return 1;
+}
+#endif				/* SEEK_DATA */
+
+
+/*
+ * With --write-behind, start keeping track of how much has been written to
+ * standard output if it is a regular file or block device, so that
+ * pv_transfer_writebehind() can flush it as we go.
+ */
+void pv_transfer_writebehind_init(pvstate_t state)
+{
+	struct stat64 sb;
+	long long offset;
+
+	state->writebehind_active = 0;
+
+	if ((!state->write_behind) || (state->direct_output))
+		return;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return;
+	if ((!S_ISREG(sb.st_mode)) && (!S_ISBLK(sb.st_mode)))
+		return;
+
+	offset = pv__transfer_output_offset();
+	if (offset < 0)
+		return;
+
+	state->writebehind_start = offset;
+	state->writebehind_offset = offset;
+	state->writebehind_queued = offset;
+	state->writebehind_durable = offset;
+	state->writebehind_active = 1;
+}
+
+
+/*
+ * Wait for the output up to "end" to be written back to disk, and drop it
+ * from the page cache.
+ */
+static void pv__transfer_writebehind_wait(pvstate_t state,
+					  unsigned long long end)
+{
+	unsigned long long start;
+
+	start = state->writebehind_durable;
+	if (end <= start)
+		return;
+
+	debug("%s: %llu-%llu", "write-behind", start, end);
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (0 != sync_file_range(STDOUT_FILENO, (off64_t) start,
+				 (off64_t) (end - start),
+				 SYNC_FILE_RANGE_WAIT_BEFORE |
+				 SYNC_FILE_RANGE_WRITE |
+				 SYNC_FILE_RANGE_WAIT_AFTER)) {
+		debug("%s: %s", "sync_file_range", strerror(errno));
+		fdatasync(STDOUT_FILENO);
+	}
+#else				/* !HAVE_SYNC_FILE_RANGE */
+	fdatasync(STDOUT_FILENO);
+#endif				/* HAVE_SYNC_FILE_RANGE */
+
+#ifdef HAVE_POSIX_FADVISE
+	/*
+	 * Start a chunk early and aligned, for the same reasons as in
+	 * pv_file_advise().
+	 */
+	start -= start % DROP_BEHIND_CHUNK;
+	if (start >= DROP_BEHIND_CHUNK)
+		start -= DROP_BEHIND_CHUNK;
+	posix_fadvise(STDOUT_FILENO, (off_t) start, (off_t) (end - start),
+		      POSIX_FADV_DONTNEED);
+#endif				/* HAVE_POSIX_FADVISE */
+
+	state->writebehind_durable = end;
+}
+
+
+/*
+ * Record that "written" more bytes have been written to standard output.
+ * With write-behind active, each time another WRITE_BEHIND_CHUNK has built
+ * up, start writing it back, and then wait for the chunk before it, so
+ * that the writes are held back to the speed of the disk.
+ */
+void pv_transfer_writebehind(pvstate_t state, long written)
+{
+	unsigned long long queued;
+
+	if ((!state->writebehind_active) || (written <= 0))
+		return;
+
+	state->writebehind_offset += written;
+	if (state->writebehind_offset - state->writebehind_queued <
+	    WRITE_BEHIND_CHUNK)
+		return;
+
+	queued = state->writebehind_queued;
+	state->writebehind_queued = state->writebehind_offset;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(STDOUT_FILENO, (off64_t) queued,
+			(off64_t) (state->writebehind_offset - queued),
+			SYNC_FILE_RANGE_WRITE);
+#endif				/* HAVE_SYNC_FILE_RANGE */
+
+	pv__transfer_writebehind_wait(state, queued);
+}
+
+
+/*
+ * Flush standard output to disk, recording any error in "flush".
+ */
+static void pv__transfer_flush_sync(struct pvflush_s *flush)
+{
+	flush->error = 0;
+	if (0 != fsync(STDOUT_FILENO)) {
+		/*
+		 * Some devices can't be fsync()ed, which isn't a failure
+		 * to write anything.
+		 */
+		if ((EINVAL != errno) && (EROFS != errno))
+			flush->error = errno;
+	}
+	__atomic_store_n(&(flush->done), 1, __ATOMIC_RELEASE);
+}
+
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Thread to flush standard output to disk in the background.
+ */
+static void *pv__transfer_flush_thread(void *arg)
+{
+	pv__transfer_flush_sync((struct pvflush_s *) arg);
+	return NULL;
+}
+#endif				/* HAVE_LIBPTHREAD */
+
+
+/*
+ * Return the number of bytes of dirty data, and data being written back,
+ * across the whole system, or 0 if this can't be found out.
+ */
+static unsigned long long pv__transfer_dirty_bytes(void)
+{
+	unsigned long long total, kb;
+	char line[256];
+	FILE *fptr;
+
+	fptr = fopen("/proc/meminfo", "r");
+	if (NULL == fptr)
+		return 0;
+
+	total = 0;
+	while (NULL != fgets(line, sizeof(line), fptr)) {
+		if ((1 == sscanf(line, "Dirty: %llu", &kb))
+		    || (1 == sscanf(line, "Writeback: %llu", &kb)))
+			total += kb * 1024;
+	}
+
+	fclose(fptr);
+
+	return total;
+}
+
+
+/*
+ * With --flush, once everything has been written, start flushing standard
+ * output to disk if it is a regular file or block device.  Returns nonzero
+ * if the flush is going on in the background, in which case
+ * pv_transfer_flush_check() should be called until it returns zero.
+ */
+int pv_transfer_flush_start(pvstate_t state)
+{
+	struct pvflush_s *flush;
+	struct stat64 sb;
+
+	if ((!state->flush) || (NULL != state->flushing))
+		return 0;
+	if (0 != fstat64(STDOUT_FILENO, &sb))
+		return 0;
+	if ((!S_ISREG(sb.st_mode)) && (!S_ISBLK(sb.st_mode)))
+		return 0;
+
+	flush = calloc(1, sizeof(*flush));
+	if (NULL == flush)
+		return 0;
+
+	state->flushing = flush;
+
+#ifdef HAVE_LIBPTHREAD
+	if (0 ==
+	    pthread_create(&(flush->thread), NULL,
+			   pv__transfer_flush_thread, flush))
+		return 1;
+	debug("%s: %s", "pthread_create", strerror(errno));
+#endif				/* HAVE_LIBPTHREAD */
+
+	/*
+	 * Without a thread, we just have to wait.
+	 */
+	pv__transfer_flush_sync(flush);
+	pv_transfer_flush_check(state, NULL);
+
+	return 0;
+}
+
+
+/*
+ * Return nonzero if the flush started by pv_transfer_flush_start() is still
+ * going on, after waiting briefly for it, and if "remaining" is not NULL,
+ * put an estimate of the number of bytes it still has to write there.
+ * Once the flush has finished, reports any error and returns zero.
+ */
+int pv_transfer_flush_check(pvstate_t state, unsigned long long *remaining)
+{
+	struct pvflush_s *flush;
+
+	flush = state->flushing;
+	if (NULL == flush)
+		return 0;
+
+	if (!__atomic_load_n(&(flush->done), __ATOMIC_ACQUIRE)) {
+		struct timeval tv;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 50000;
+		select(0, NULL, NULL, NULL, &tv);
+
+		if (!__atomic_load_n(&(flush->done), __ATOMIC_ACQUIRE)) {
+			if (NULL != remaining)
+				*remaining = pv__transfer_dirty_bytes();
+			return 1;
+		}
+	}
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_join(flush->thread, NULL);
+#endif				/* HAVE_LIBPTHREAD */
+
+	if (0 != flush->error) {
+		pv_error(state, "%s: %s", _("failed to flush output"),
+			 strerror(flush->error));
+		state->exit_status |= 16;
+	}
+
+	free(flush);
+	state->flushing = NULL;
+
+	return 0;
+}
+
+
+/*
+ * Once everything has been written, wait for the rest of the output to be
+ * written back to disk.
+ */
+void pv_transfer_writebehind_finish(pvstate_t state)
+{
+	if (!state->writebehind_active)
+		return;
+
+	state->writebehind_queued = state->writebehind_offset;
+	pv__transfer_writebehind_wait(state, state->writebehind_offset);
+}
+
+
+/*
+ * Stop using O_DIRECT on the given input file descriptor, so that an
+ * unaligned read can be done - this is the buffered tail of the input.
+ */
+static void pv__transfer_direct_input_off(pvstate_t state, int fd)
+{
+	debug("%s %d: %s", "fd", fd, "switching to buffered input");
+	pv_transfer_direct_set(fd, 0);
+	state->direct_input_fd = -1;
+}
+
+
+/*
+ * If standard output is using O_DIRECT, cut state->to_write down to a
+ * whole number of aligned blocks.  If there is less than a block to write
+ * and the input is at its end, or if the write position is not aligned,
+ * O_DIRECT is turned off for the rest of the transfer so that the tail can
+ * be written normally, since the output file offset will not be aligned
+ * after that.
+ */
+static void pv__transfer_direct_output_trim(pvstate_t state, int eof_in)
+{
+	long aligned;
+
+	if (!state->direct_output)
+		return;
+
+	aligned = state->to_write - (state->to_write % state->direct_align);
+
+	if ((0 == (state->write_position % state->direct_align))
+	    && ((aligned > 0) || (!eof_in))) {
+		state->to_write = aligned;
+		return;
+	}
+
+	debug("%s", "switching to buffered output");
+	pv_transfer_direct_set(STDOUT_FILENO, 0);
+	state->direct_output = 0;
+}
+
+
+/*
+ * Return how much to read from the input "fd", which is using O_DIRECT,
+ * given that "bytes_can_read" bytes of the buffer are free: a whole number
+ * of aligned blocks, or 0 to wait until there is room for one.  If the
+ * read position is not aligned, O_DIRECT is turned off and all of the free
+ * space can be used.
+ */
+static unsigned long pv__transfer_direct_read_size(pvstate_t state, int fd,
+						   unsigned long
+						   bytes_can_read)
+{
+	if (0 != (state->read_position % state->direct_align)) {
+		pv__transfer_direct_input_off(state, fd);
+		return bytes_can_read;
+	}
+	return bytes_can_read - (bytes_can_read % state->direct_align);
+}
+
+
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef MAP_ANONYMOUS
+/*
+ * Return the length of the memory mapping to use for a transfer buffer of
+ * "size" bytes, with --huge-pages or --mlock.
+ */
+static unsigned long long pv__transfer_buffer_maplen(pvstate_t state,
+						     unsigned long long size)
+{
+	unsigned long long unit;
+
+	unit = state->huge_pages ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+	if (unit < 1)
+		unit = 4096;
+
+	return ((size + 32 + unit - 1) / unit) * unit;
+}
+
+
+/*
+ * Map "length" bytes of anonymous memory for the transfer buffer, backed
+ * by huge pages if possible when --huge-pages was given, returning NULL on
+ * failure.
+ */
+static unsigned char *pv__transfer_buffer_map(pvstate_t state,
+					      unsigned long long length)
+{
+	unsigned char *ptr;
+	unsigned long long extra;
+
+	/*
+	 * Explicit huge pages are only there if the administrator has set
+	 * some aside, so fall back to transparent huge pages if not.
+	 */
+#ifdef MAP_HUGETLB
+	if (state->huge_pages) {
+		ptr =
+		    mmap(NULL, length, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED != ptr) {
+			debug("%s: %llu", "buffer mapped with MAP_HUGETLB",
+			      length);
+			return ptr;
+		}
+		debug("%s: %s", "MAP_HUGETLB", strerror(errno));
+	}
+#endif				/* MAP_HUGETLB */
+
+	/*
+	 * Transparent huge pages need the buffer to be aligned to the huge
+	 * page size, so map more than we need and trim off the ends.
+	 */
+	extra = state->huge_pages ? HUGE_PAGE_SIZE : 0;
+	ptr =
+	    mmap(NULL, length + extra, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == ptr)
+		return NULL;
+
+	if (extra > 0) {
+		unsigned long long head;
+
+		head = (unsigned long) ptr % HUGE_PAGE_SIZE;
+		if (head > 0)
+			head = HUGE_PAGE_SIZE - head;
+		if (head > 0)
+			munmap(ptr, head);
+		if (extra - head > 0)
+			munmap(ptr + head + length, extra - head);
+		ptr += head;
+	}
+#ifdef MADV_HUGEPAGE
+	if ((state->huge_pages)
+	    && (0 != madvise(ptr, length, MADV_HUGEPAGE)))
+		debug("%s: %s", "MADV_HUGEPAGE", strerror(errno));
+#endif				/* MADV_HUGEPAGE */
+
+	return ptr;
+}
+#endif				/* MAP_ANONYMOUS */
+
+
+/*
+ * Allocate a transfer buffer of "size" bytes, aligned for O_DIRECT if it
+ * is in use.
+ *
+ * With --huge-pages or --mlock, the buffer is mapped separately, touched
+ * all the way through so that it won't take page faults mid-transfer, and
+ * with --mlock, locked into memory.
+ */
+unsigned char *pv_transfer_buffer_alloc(pvstate_t state,
+					unsigned long long size)
+{
+	void *ptr;
+
+#ifdef MAP_ANONYMOUS
+	if ((state->huge_pages) || (state->mlock)) {
+		unsigned long long length;
+		unsigned char *buf;
+
+		length = pv__transfer_buffer_maplen(state, size);
+		buf = pv__transfer_buffer_map(state, length);
+		if (NULL == buf)
+			return NULL;
+
+		memset(buf, 0, length);
+
+		if ((state->mlock) && (0 != mlock(buf, length))) {
+			pv_error(state, "%s: %s",
+				 _("failed to lock buffer into memory"),
+				 strerror(errno));
+		}
+
+		return buf;
+	}
+#endif				/* MAP_ANONYMOUS */
+
+	if (!state->direct_io)
+		return (unsigned char *) malloc(size + 32);
+
+	if (posix_memalign(&ptr, state->direct_align, size + 32) != 0)
+		return NULL;
+
+	return (unsigned char *) ptr;
+}
+
+
+/*
+ * Free a transfer buffer of "size" bytes that was allocated with
+ * pv_transfer_buffer_alloc().
+ */
+void pv_transfer_buffer_free(pvstate_t state, unsigned char *buf,
+			     unsigned long long size)
+{
+	if (NULL == buf)
+		return;
+
+#ifdef MAP_ANONYMOUS
+	if ((state->huge_pages) || (state->mlock)) {
+		munmap(buf, pv__transfer_buffer_maplen(state, size));
+		return;
+	}
+#endif				/* MAP_ANONYMOUS */
+
+	free(buf);
+}
+
+
+/*
+ * Return the memory limit of the cgroup we are running in, or of the
+ * cgroup above it with the lowest limit, or 0 if there is no limit or it
+ * cannot be found.  Both version 2 (memory.max) and version 1
+ * (memory.limit_in_bytes) cgroups are looked at.
+ */
+static unsigned long long pv__transfer_cgroup_limit(void)
+{
+	char line[4096];
+	char path[4096 + 64];
+	unsigned long long lowest;
+	FILE *fptr;
+
+	lowest = 0;
+
+	fptr = fopen("/proc/self/cgroup", "r");
+	if (NULL == fptr)
+		return 0;
+
+	while (NULL != fgets(line, sizeof(line), fptr)) {
+		const char *base, *file;
+		char *controllers, *group, *end;
+
+		controllers = strchr(line, ':');
+		if (NULL == controllers)
+			continue;
+		controllers++;
+		group = strchr(controllers, ':');
+		if (NULL == group)
+			continue;
+		*group = 0;
+		group++;
+		end = strchr(group, '\n');
+		if (NULL != end)
+			*end = 0;
+
+		if (0 == controllers[0]) {
+			base = "/sys/fs/cgroup";
+			file = "memory.max";
+		} else if (0 == strcmp(controllers, "memory")) {
+			base = "/sys/fs/cgroup/memory";
+			file = "memory.limit_in_bytes";
+		} else {
+			continue;
+		}
+
+		/*
+		 * Check the limit of each cgroup from ours up to the root,
+		 * since any of them could be the one that applies.
+		 */
+		while (1) {
+			unsigned long long limit;
+			FILE *limitfptr;
+
+			if (0 == strcmp(group, "/")) {
+				snprintf(path, sizeof(path), "%s/%s", base,
+					 file);
+			} else {
+				snprintf(path, sizeof(path), "%s%s/%s", base,
+					 group, file);
+			}
+
+			limitfptr = fopen(path, "r");
+			if (NULL != limitfptr) {
+				if ((1 == fscanf(limitfptr, "%llu", &limit))
+				    && (limit > 0)
+				    && ((0 == lowest) || (limit < lowest)))
+					lowest = limit;
+				fclose(limitfptr);
+			}
+
+			end = strrchr(group, '/');
+			if ((NULL == end) || (0 == strcmp(group, "/")))
+				break;
+			if (end == group)
+				end++;
+			*end = 0;
+		}
+	}
+
+	fclose(fptr);
+
+	return lowest;
+}
+
+
+/*
+ * Unless a buffer size was given, or the buffer is fixed in place because
+ * of --huge-pages or --mlock, adjust the target buffer size once every
+ * BUFFER_ADAPT_USEC microseconds, given that the time is now "now".
+ *
+ * If the buffer was full while there was more to read for most of the
+ * time, because output is not keeping up with input, the buffer size is
+ * doubled so that bursts of input can be taken in without waiting; if
+ * the buffer was never more than a quarter full for BUFFER_ADAPT_IDLE
+ * checks in a row, it is halved, so that idle or steady transfers don't
+ * hold on to memory they don't need.  The size is kept between
+ * BUFFER_ADAPT_MIN and BUFFER_ADAPT_MAX, and to no more than
+ * 1/BUFFER_ADAPT_CGROUP of the memory limit of our cgroup.
+ *
+ * The buffer itself is resized by pv_transfer(), once the data in it will
+ * fit.  In threaded mode, the buffer size is fixed.
+ */
+void pv_transfer_buffer_adapt(pvstate_t state, struct timeval *now)
+{
+	unsigned long long size;
+
+	if ((!state->buffer_adaptive) || (state->huge_pages)
+	    || (state->mlock) || (NULL != state->threads))
+		return;
+
+	if (0 == state->adapt_max) {
+		unsigned long long limit;
+
+		state->adapt_min = BUFFER_ADAPT_MIN;
+		state->adapt_max = BUFFER_ADAPT_MAX;
+		limit = pv__transfer_cgroup_limit() / BUFFER_ADAPT_CGROUP;
+		if ((limit > 0) && (limit < state->adapt_max))
+			state->adapt_max = limit;
+		if (state->adapt_max < state->adapt_min)
+			state->adapt_max = state->adapt_min;
+		debug("%s: %llu - %llu", "adaptive buffer size range",
+		      state->adapt_min, state->adapt_max);
+
+		state->adapt_check.tv_sec = now->tv_sec;
+		state->adapt_check.tv_usec = now->tv_usec;
+	}
+
+	if ((now->tv_sec - state->adapt_check.tv_sec) * 1000000L +
+	    (now->tv_usec - state->adapt_check.tv_usec) < BUFFER_ADAPT_USEC)
+		return;
+
+	state->adapt_check.tv_sec = now->tv_sec;
+	state->adapt_check.tv_usec = now->tv_usec;
+
+	size = state->target_buffer_size;
+
+	if ((state->adapt_calls > 0)
+	    && (state->adapt_full * 2 >= state->adapt_calls)) {
+		size *= 2;
+		state->adapt_idle = 0;
+	} else if ((NULL != state->transfer_buffer)
+		   && (state->adapt_peak * 4 < state->buffer_size)) {
+		state->adapt_idle++;
+		if (state->adapt_idle >= BUFFER_ADAPT_IDLE) {
+			size /= 2;
+			state->adapt_idle = 0;
+		}
+	} else {
+		state->adapt_idle = 0;
+	}
+
+	if (size < state->adapt_min)
+		size = state->adapt_min;
+	if (size > state->adapt_max)
+		size = state->adapt_max;
+
+	if (size != state->target_buffer_size) {
+		debug("%s: %llu -> %llu", "buffer target size",
+		      state->target_buffer_size, size);
+		state->target_buffer_size = size;
+	}
+
+	state->adapt_calls = 0;
+	state->adapt_full = 0;
+	state->adapt_peak = 0;
+}
+
+
+/*
+ * Return how much can be read from "fd" into the transfer buffer next,
+ * given the room in the buffer, O_DIRECT alignment, and where the next
+ * hole in a sparse input starts.
+ */
+static unsigned long pv__transfer_read_size(pvstate_t state, int fd)
+{
+	unsigned long bytes_can_read;
+
+	bytes_can_read = state->buffer_size -
+	    (state->read_position - state->write_position);
+
+	if (fd == state->direct_input_fd) {
+		bytes_can_read =
+		    pv__transfer_direct_read_size(state, fd, bytes_can_read);
+	}
+
+	if ((fd == state->sparse_input_fd)
+	    && (state->sparse_next_hole > state->sparse_in_offset)
+	    && (bytes_can_read >
+		state->sparse_next_hole - state->sparse_in_offset)) {
+		bytes_can_read =
+		    state->sparse_next_hole - state->sparse_in_offset;
+	}
+
+	return bytes_can_read;
+}
+
+
+/*
+ * Read some data from the given file descriptor. Returns zero if there was
+ * a transient error and we need to return 0 from pv_transfer, otherwise
+ * returns 1.
+ *
+ * At most, the number of bytes read will be the number of bytes remaining
+ * in the input buffer.  If state->rate_limit is >0, and/or "allowed" is >0,
+ * then the maximum number of bytes read will be the number remaining unused
+ * in the input buffer or the value of "allowed", whichever is smaller.
+ *
+ * If splice() (or copy_file_range() or sendfile() - see
+ * pv__transfer_kernel_copy()) was successfully used, sets
+ * state->splice_used to 1; if it failed, then state->splice_failed_fd is
+ * updated to the current fd so it won't be tried again until the next
+ * input file.
+ *
+ * Updates state->read_position by the number of bytes read, unless splice()
+ * was used, in which case it does not since there's nothing in the buffer
+ * (and it also adds the bytes to state->written since they've been written
+ * to the output).
+ *
+ * On read error, updates state->exit_status, and if allowed by
+ * state->skip_errors, tries to skip past the problem.
+ *
+ * If the end of the input file is reached or the error is unrecoverable,
+ * sets *eof_in to 1.  If all data in the buffer has been written at this
+ * point, then also sets *eof_out.
+ */
+static int pv__transfer_read(pvstate_t state, int fd,
+			     int *eof_in, int *eof_out,
+			     unsigned long long allowed,
+			     long *lineswritten)
+{
+	unsigned long bytes_can_read;
+	long amount_skipped;
+	ssize_t nread;
+	struct iovec iov[2];
+	int iovcnt, idx;
+#ifdef HAVE_SPLICE
+	size_t bytes_to_splice;
+#endif				/* HAVE_SPLICE */
+
+	bytes_can_read = state->buffer_size -
+	    (state->read_position - state->write_position);
+
+#ifdef SEEK_DATA
+	if ((fd == state->sparse_input_fd)
+	    && (pv__transfer_sparse_read(state, fd, allowed, bytes_can_read)))
+		return 1;
+#endif				/* SEEK_DATA */
+
+#ifdef HAVE_SPLICE
+	state->splice_used = 0;
+	if ((!state->linemode) && (!state->no_splice)
+	    && (!state->direct_io) && (!state->sparse)
+	    && (fd != state->splice_failed_fd)
+	    && (0 == state->to_write)) {
+		if (state->rate_limit || allowed != 0)
+			bytes_to_splice = allowed;
+		else
+			bytes_to_splice = bytes_can_read;
+
+		nread =
+		    pv__transfer_kernel_copy(state, fd, bytes_to_splice);
+
+		state->splice_used = 1;
+		if ((nread < 0)
+		    && ((EINVAL == errno) || (EXDEV == errno)
+			|| (ENOSYS == errno) || (EOPNOTSUPP == errno)
+			|| (EBADF == errno))) {
+			/*
+			 * EXDEV, ENOSYS, and EOPNOTSUPP come from
+			 * copy_file_range() on older kernels or between
+			 * filesystems that don't support it, and EBADF
+			 * if the output was opened for appending.
+			 */
+			debug("%s %d: %s: %s", "fd", fd,
+			      "kernel copy failed - disabling",
+			      strerror(errno));
+			state->splice_failed_fd = fd;
+			state->splice_used = 0;
+			/*
+			 * Fall through to read() below.
+			 */
+		} else if (nread > 0) {
+			state->written = nread;
+		} else if ((-1 == nread) && (EAGAIN == errno)) {
+			/* nothing read yet - do nothing */
+		} else {
+			/* EOF might not really be EOF, it seems */
+			state->splice_used = 0;
+		}
+	}
+	if (0 == state->splice_used) {
+		/*
+		 * A failed pv__transfer_splice_pipe() may have put data in
+		 * the buffer, possibly filling it.
+		 */
+		bytes_can_read = pv__transfer_read_size(state, fd);
+		if (0 == bytes_can_read)
+			return 1;
+		iovcnt =
+		    pv__transfer_ring_iov(state, state->read_position,
+					  bytes_can_read, iov);
+		nread = pv__transfer_read_repeated(fd, iov, iovcnt);
+	}
+#else
+	bytes_can_read = pv__transfer_read_size(state, fd);
+	if (0 == bytes_can_read)
+		return 1;
+	iovcnt =
+	    pv__transfer_ring_iov(state, state->read_position,
+				  bytes_can_read, iov);
+	nread = pv__transfer_read_repeated(fd, iov, iovcnt);
+#endif				/* HAVE_SPLICE */
+
+
+	if (0 == nread) {
+		/*
+		 * If read returned 0, we've reached the end of this input
+		 * file.  If we've also written all the data in the transfer
+		 * buffer, we set eof_out as well, so that the main loop can
+		 * move on to the next input file.
+		 */
+		*eof_in = 1;
+		if (state->write_position >= state->read_position)
+			*eof_out = 1;
+		return 1;
+	} else if (nread > 0) {
+		/*
+		 * Read returned >0, so we successfully read data - clear
+		 * the error counter and update our record of how much data
+		 * we've got in the buffer.
+		 */
+		state->read_errors_in_a_row = 0;
+		pv_file_advise(state, fd, nread);
+		if (fd == state->sparse_input_fd)
+			state->sparse_in_offset += nread;
+#ifdef HAVE_SPLICE
+		/*
+		 * If we used splice(), there isn't any more data in the
+		 * buffer than there was before.
+		 */
+		if (0 == state->splice_used)
+			state->read_position += nread;
+#else
+		state->read_position += nread;
+#endif				/* HAVE_SPLICE */
+		return 1;
+	}
+
+	/*
+	 * If we reach this point, nread<0, so there was an error.
+	 */
+
+	/*
+	 * If a read error occurred but it was EINTR or EAGAIN, just wait a
+	 * bit and then return zero, since this was a transient error.
+	 */
+	if ((EINTR == errno) || (EAGAIN == errno)) {
+		struct timeval tv;
+		debug("%s %d: %s: %s", "fd", fd,
+		      "transient error - waiting briefly",
+		      strerror(errno));
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		select(0, NULL, NULL, NULL, &tv);
+		return 0;
+	}
+
+	/*
+	 * An O_DIRECT read fails with EINVAL if the file offset is not
+	 * aligned, such as after skipping past an error, so carry on
+	 * without O_DIRECT.
+	 */
+	if ((EINVAL == errno) && (fd == state->direct_input_fd)) {
+		pv__transfer_direct_input_off(state, fd);
+		return 0;
+	}
+
+	/*
+	 * Skipping past the error would leave our idea of where we are in
+	 * the file wrong, so stop looking for holes in it.
+	 */
+	if (fd == state->sparse_input_fd)
+		state->sparse_input_fd = -1;
+
+	/*
+	 * The error is not transient, so report it and try to skip past it
+	 * if we're allowed to; if we can't, pretend we reached the end of
+	 * the file.
 	 */
+	amount_skipped =
+	    pv_transfer_read_error(state, fd, bytes_can_read);
+
 	if (amount_skipped > 0) {
-		memset(state->transfer_buffer +
-		       state->read_position, 0, amount_skipped);
+		iovcnt =
+		    pv__transfer_ring_iov(state, state->read_position,
+					  amount_skipped, iov);
+		for (idx = 0; idx < iovcnt; idx++)
+			memset(iov[idx].iov_base, 0, iov[idx].iov_len);
 		state->read_position += amount_skipped;
-		if (state->skip_errors < 2) {
-			pv_error(state, "%s: %s: %ld - %ld (%ld %s)",
-				 state->current_file,
-				 _
-				 ("skipped past read error"),
-				 orig_offset,
-				 skip_offset, amount_skipped, _("B"));
-		}
 	} else {
-		/*
-		 * Failed to skip - mark file as ended.
-		 */
 		*eof_in = 1;
 		if (state->write_position >= state->read_position) {
 			*eof_out = 1;
@@ -472,9 +2236,11 @@ static int pv__transfer_read(pvstate_t state, int fd,
 
 
 /*
- * Write state->to_write bytes of data from the transfer buffer to stdout.
- * Returns zero if there was a transient error and we need to return 0 from
- * pv_transfer, otherwise returns 1.
+ * Account for the result "nwritten" of a write of state->to_write bytes
+ * from the transfer buffer to stdout, where "nwritten" is as returned by
+ * write(), with errno set if it is negative.  Returns zero if there was a
+ * transient error and we need to return 0 from pv_transfer, otherwise
+ * returns 1.
  *
  * Updates state->write_position by moving it on by the number of bytes
  * written; adds the number of bytes written to state->written; sets
@@ -484,22 +2250,10 @@ static int pv__transfer_read(pvstate_t state, int fd,
  * On error, sets *eof_out to 1, sets state->written to -1, and updates
  * state->exit_status.
  */
-static int pv__transfer_write(pvstate_t state, int fd,
-			      int *eof_in, int *eof_out,
-			      long *lineswritten)
+static int pv__transfer_write_result(pvstate_t state,
+				     int *eof_in, int *eof_out,
+				     long *lineswritten, ssize_t nwritten)
 {
-	ssize_t nwritten;
-
-	signal(SIGALRM, SIG_IGN);
-	alarm(1);
-
-	nwritten = pv__transfer_write_repeated(STDOUT_FILENO,
-					       state->transfer_buffer +
-					       state->write_position,
-					       state->to_write);
-
-	alarm(0);
-
 	if (0 == nwritten) {
 		/*
 		 * Write returned 0 - EOF on stdout.
@@ -512,43 +2266,31 @@ static int pv__transfer_write(pvstate_t state, int fd,
 		 */
 		if ((state->linemode) && (lineswritten != NULL)) {
 			/*
-			 * Guillaume Marcais: use strchr to count \n
+			 * Count the line terminators in what was written.
 			 */
-			unsigned char save;
-			char *ptr;
+			struct iovec iov[2];
+			int iovcnt, idx;
 			long lines = 0;
 
-			save =
-			    state->transfer_buffer[state->write_position +
-						   nwritten];
-			state->transfer_buffer[state->write_position +
-					       nwritten] = 0;
-			ptr =
-			    (char *) (state->transfer_buffer +
-				      state->write_position - 1);
-
-			if (state->null) {
-				for (ptr++;
-				     ptr -
-				     (char *) state->transfer_buffer -
-				     state->write_position < nwritten;
-				     ptr++) {
-					if (*ptr == '\0')
-						++lines;
-				}
-			} else {
-				while ((ptr =
-					strchr((char *) (ptr + 1), '\n')))
-					++lines;
+			iovcnt =
+			    pv__transfer_ring_iov(state,
+						  state->write_position,
+						  nwritten, iov);
+
+			for (idx = 0; idx < iovcnt; idx++) {
+				lines +=
+				    pv_count_byte(iov[idx].iov_base,
+						  iov[idx].iov_len,
+						  state->null ? 0 : '\n');
 			}
 
 			*lineswritten += lines;
-			state->transfer_buffer[state->write_position +
-					       nwritten] = save;
 		}
 
 		state->write_position += nwritten;
 		state->written += nwritten;
+		if (state->sparse_output)
+			state->sparse_out_offset += nwritten;
 
 		/*
 		 * If we're monitoring the output, update our copy of the
@@ -557,6 +2299,8 @@ static int pv__transfer_write(pvstate_t state, int fd,
 		if (((state->components_used & PV_DISPLAY_OUTPUTBUF) != 0)
 		    && (nwritten > 0)) {
 			long new_portion_length, old_portion_length;
+			struct iovec iov[2];
+			int iovcnt, idx;
 
 			new_portion_length = nwritten;
 			if (new_portion_length > state->lastoutput_length)
@@ -579,11 +2323,17 @@ static int pv__transfer_write(pvstate_t state, int fd,
 			/*
 			 * Copy the new data in.
 			 */
-			memcpy(state->lastoutput_buffer +
-			       old_portion_length,
-			       state->transfer_buffer +
-			       state->write_position - new_portion_length,
-			       new_portion_length);
+			iovcnt =
+			    pv__transfer_ring_iov(state,
+						  state->write_position -
+						  new_portion_length,
+						  new_portion_length, iov);
+			for (idx = 0; idx < iovcnt; idx++) {
+				memcpy(state->lastoutput_buffer +
+				       old_portion_length, iov[idx].iov_base,
+				       iov[idx].iov_len);
+				old_portion_length += iov[idx].iov_len;
+			}
 		}
 
 		/*
@@ -593,8 +2343,10 @@ static int pv__transfer_write(pvstate_t state, int fd,
 		 * everything for this input file.
 		 */
 		if (state->write_position >= state->read_position) {
-			state->write_position = 0;
-			state->read_position = 0;
+			if (!pv__transfer_uring_busy(state)) {
+				state->write_position = 0;
+				state->read_position = 0;
+			}
 			if (*eof_in)
 				*eof_out = 1;
 		}
@@ -637,12 +2389,511 @@ static int pv__transfer_write(pvstate_t state, int fd,
 }
 
 
+/*
+ * Write state->to_write bytes of data from the transfer buffer to stdout.
+ * Returns as pv__transfer_write_result() does.
+ */
+static int pv__transfer_write(pvstate_t state, int fd,
+			      int *eof_in, int *eof_out,
+			      long *lineswritten)
+{
+	struct iovec iov[2];
+	int iovcnt;
+	ssize_t nwritten;
+
+	/*
+	 * With sparse output, skip over any zero blocks at the start of
+	 * what is to be written, and otherwise only write up to the next
+	 * zero block.
+	 */
+	if (state->sparse_output) {
+		unsigned long run;
+		int zero;
+
+		run = pv__transfer_sparse_run(state, &zero);
+		if (zero > 0) {
+			if (lseek64(STDOUT_FILENO, run, SEEK_CUR) >= 0)
+				return pv__transfer_write_result(state,
+								 eof_in,
+								 eof_out,
+								 lineswritten,
+								 run);
+			debug("%s: %s", "lseek", strerror(errno));
+			state->sparse_output = 0;
+		} else if (run > 0) {
+			state->to_write = run;
+		}
+	}
+
+	iovcnt =
+	    pv__transfer_ring_iov(state, state->write_position,
+				  state->to_write, iov);
+
+	signal(SIGALRM, SIG_IGN);
+	alarm(1);
+
+	nwritten = pv__transfer_write_repeated(STDOUT_FILENO, iov, iovcnt);
+
+	alarm(0);
+
+	/*
+	 * If the output device or filesystem turns out not to accept our
+	 * O_DIRECT writes, carry on without it.
+	 */
+	if ((nwritten < 0) && (EINVAL == errno) && (state->direct_output)) {
+		debug("%s", "O_DIRECT write failed - switching to buffered");
+		pv_transfer_direct_set(STDOUT_FILENO, 0);
+		state->direct_output = 0;
+		return 0;
+	}
+
+	return pv__transfer_write_result(state, eof_in, eof_out,
+					 lineswritten, nwritten);
+}
+
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Return nonzero if the io_uring engine should be used for this transfer,
+ * setting it up if this is the first time it's been needed.
+ */
+static int pv__transfer_uring_ready(pvstate_t state, int fd)
+{
+	if ((0 == state->io_uring) || (state->direct_io) || (state->sparse))
+		return 0;
+
+	/*
+	 * Anything already in flight has to be seen through, even if we
+	 * have since decided to fall back to read() and write().
+	 */
+	if (pv__transfer_uring_busy(state))
+		return 1;
+
+	if (fd == state->uring_failed_fd)
+		return 0;
+
+	if ((NULL == state->uring) && (pv__uring_setup(state) != 0)) {
+		debug("%s %d: %s", "fd", fd,
+		      "io_uring setup failed - disabling");
+		state->uring_failed_fd = fd;
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Mark all queued reads after the first one as discarded, and wind the
+ * next read offset back to just after what the first one returned.
+ */
+static void pv__transfer_uring_discard(struct pvuring_s *ring, long kept)
+{
+	int i;
+
+	for (i = 1; i < ring->reads_queued; i++)
+		ring->reads[i].discard = 1;
+
+	if (ring->read_offset >= 0)
+		ring->read_offset = ring->reads[0].file_offset + kept;
+}
+
+
+/*
+ * Transfer data using the io_uring engine, as pv_transfer() would with
+ * select(), read(), and write(): queue reads into the free part of the
+ * transfer buffer and a write of state->to_write bytes from it, wait for
+ * something to complete or for the same timeout that pv_transfer() uses
+ * for select(), and then account for whatever has completed.
+ *
+ * If the input is seekable, up to URING_MAX_READS reads of at most
+ * URING_READ_CHUNK bytes are queued at explicit offsets; otherwise only one
+ * read is queued at a time, at the current position.  Completed reads are
+ * only added to the buffer in order, and if one comes up short, the reads
+ * queued after it are discarded and issued again.
+ *
+ * A read error sets state->uring_failed_fd once everything in flight has
+ * completed, so that the next call retries with read() and handles the
+ * error in the usual way.
+ *
+ * Returns zero on a transient error, otherwise 1.
+ */
+static int pv__transfer_uring(pvstate_t state, int fd,
+			      int *eof_in, int *eof_out,
+			      long *lineswritten)
+{
+	struct pvuring_s *ring;
+	int write_done, write_result;
+	int i;
+
+	ring = state->uring;
+
+	/*
+	 * Work out where reads should start if this is a new input file.
+	 */
+	if (fd != ring->read_fd) {
+		struct stat64 sb;
+
+		ring->read_fd = fd;
+		ring->read_eof = 0;
+		ring->read_failed = 0;
+		ring->read_offset = -1;
+		if ((0 == fstat64(fd, &sb))
+		    && (S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode)))
+			ring->read_offset = lseek64(fd, 0, SEEK_CUR);
+	}
+
+	/*
+	 * Queue reads into the free space in the buffer, unless we are
+	 * waiting for discarded reads to come back.
+	 */
+	for (i = 0; i < ring->reads_queued; i++) {
+		if (ring->reads[i].discard)
+			break;
+	}
+	while ((!(*eof_in)) && (!ring->read_eof) && (!ring->read_failed)
+	       && (i >= ring->reads_queued)
+	       && (ring->reads_queued < URING_MAX_READS)) {
+		struct pvuring_read_s *rd;
+		unsigned long long start, offset, space;
+		unsigned long length;
+
+		if (0 == ring->reads_queued) {
+			start = state->read_position;
+		} else if (ring->read_offset < 0) {
+			break;
+		} else {
+			rd = &(ring->reads[ring->reads_queued - 1]);
+			start = rd->position + rd->length;
+		}
+
+		space = state->buffer_size - (start - state->write_position);
+		if (0 == space)
+			break;
+
+		offset = start % state->buffer_size;
+		length = state->buffer_size - offset;
+		if (length > space)
+			length = space;
+		if ((ring->read_offset >= 0) && (length > URING_READ_CHUNK))
+			length = URING_READ_CHUNK;
+		if (length > MAX_READ_AT_ONCE)
+			length = MAX_READ_AT_ONCE;
+
+		if (pv__uring_queue
+		    (ring, IORING_OP_READ, fd,
+		     state->transfer_buffer + offset, length,
+		     (unsigned long long) (ring->read_offset), ring->next_id))
+			break;
+
+		rd = &(ring->reads[ring->reads_queued]);
+		memset(rd, 0, sizeof(*rd));
+		rd->id = ring->next_id++;
+		rd->position = start;
+		rd->length = length;
+		rd->file_offset = ring->read_offset;
+		if (ring->read_offset >= 0)
+			ring->read_offset += length;
+		ring->reads_queued++;
+		i = ring->reads_queued;
+	}
+
+	/*
+	 * Queue a write if there's anything we're allowed to write, up to
+	 * the end of the buffer if the data wraps around.
+	 */
+	if ((!ring->write_inflight) && (!(*eof_out))
+	    && (state->read_position > state->write_position)
+	    && (state->to_write > 0)) {
+		unsigned long long offset;
+		unsigned long length;
+
+		offset = state->write_position % state->buffer_size;
+		length = state->to_write;
+		if (length > state->buffer_size - offset)
+			length = state->buffer_size - offset;
+
+		if (0 ==
+		    pv__uring_queue(ring, IORING_OP_WRITE, STDOUT_FILENO,
+				    state->transfer_buffer + offset, length,
+				    (unsigned long long) -1, PV_URING_WRITE))
+			ring->write_inflight = 1;
+	}
+
+	/*
+	 * Make sure we don't wait longer than select() would have.
+	 */
+	if (!ring->timeout_inflight) {
+		if (0 ==
+		    pv__uring_queue(ring, IORING_OP_TIMEOUT, -1,
+				    &(ring->timeout), 1, 1,
+				    PV_URING_TIMEOUT))
+			ring->timeout_inflight = 1;
+	}
+
+	if (pv__uring_enter(ring, 1) < 0) {
+		if ((EINTR != errno) && (EAGAIN != errno)
+		    && (EBUSY != errno)) {
+			pv_error(state, "%s: %s: %s",
+				 state->current_file,
+				 _("io_uring_enter call failed"),
+				 strerror(errno));
+			state->exit_status |= 16;
+			state->written = -1;
+			return 1;
+		}
+	}
+
+	write_result = pv__uring_reap(ring, &write_done);
+
+	/*
+	 * Add completed reads to the buffer, in order.
+	 */
+	while ((ring->reads_queued > 0) && (ring->reads[0].complete)) {
+		struct pvuring_read_s *rd;
+
+		rd = &(ring->reads[0]);
+
+		if (!rd->discard) {
+			long kept = rd->result > 0 ? rd->result : 0;
+
+			state->read_position += kept;
+			pv_file_advise(state, fd, kept);
+			if (kept < (long) (rd->length))
+				pv__transfer_uring_discard(ring, kept);
+
+			if (rd->result > 0) {
+				state->read_errors_in_a_row = 0;
+			} else if (0 == rd->result) {
+				ring->read_eof = 1;
+			} else if ((-EINTR != rd->result)
+				   && (-EAGAIN != rd->result)) {
+				debug("%s %d: %s: %s", "fd", fd,
+				      "io_uring read failed",
+				      strerror(-(rd->result)));
+				ring->read_failed = 1;
+			}
+		}
+
+		ring->reads_queued--;
+		memmove(&(ring->reads[0]), &(ring->reads[1]),
+			ring->reads_queued * sizeof(ring->reads[0]));
+	}
+
+	/*
+	 * Once all reads are back, act on end of file or a read error, and
+	 * put the file position where read() would have left it.
+	 */
+	if ((0 == ring->reads_queued)
+	    && (ring->read_eof || ring->read_failed)) {
+		if (ring->read_offset >= 0)
+			lseek64(fd, ring->read_offset, SEEK_SET);
+		if (ring->read_failed) {
+			state->uring_failed_fd = fd;
+		} else {
+			*eof_in = 1;
+			if ((state->write_position >= state->read_position)
+			    && (!ring->write_inflight))
+				*eof_out = 1;
+		}
+		ring->read_fd = -1;
+	}
+
+	if (!write_done)
+		return 1;
+
+	if (write_result < 0) {
+		if ((-EINTR == write_result) || (-EAGAIN == write_result))
+			return 0;
+		errno = -write_result;
+	}
+
+	return pv__transfer_write_result(state, eof_in, eof_out,
+					 lineswritten, write_result);
+}
+#endif				/* HAVE_LINUX_IO_URING_H */
+
+
+/*
+ * Finish with any transfer engine state, waiting for anything still in
+ * flight so that the transfer buffer can safely be freed.
+ */
+void pv_transfer_fini(pvstate_t state)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct pvuring_s *ring;
+	int write_done;
+	int i, attempts;
+#endif				/* HAVE_LINUX_IO_URING_H */
+
+	if (NULL == state)
+		return;
+
+	/*
+	 * A flush that is still going on, because we are exiting early, is
+	 * left to finish on its own, since the thread only uses its own
+	 * structure.
+	 */
+	if ((NULL != state->flushing)
+	    && (__atomic_load_n(&(state->flushing->done), __ATOMIC_ACQUIRE)))
+		pv_transfer_flush_check(state, NULL);
+	state->flushing = NULL;
+
+	pv_transfer_sparse_finish(state);
+	pv__transfer_preallocate_trim(state);
+
+	/*
+	 * Don't leave O_DIRECT set on file descriptors we inherited, since
+	 * whatever uses them next won't be expecting it.
+	 */
+	if (state->direct_output) {
+		pv_transfer_direct_set(STDOUT_FILENO, 0);
+		state->direct_output = 0;
+	}
+	if (STDIN_FILENO == state->direct_input_fd) {
+		pv_transfer_direct_set(STDIN_FILENO, 0);
+		state->direct_input_fd = -1;
+	}
+
+#ifdef HAVE_SPLICE
+	if (state->splice_pipe_fd[0] >= 0) {
+		close(state->splice_pipe_fd[0]);
+		close(state->splice_pipe_fd[1]);
+		state->splice_pipe_fd[0] = -1;
+		state->splice_pipe_fd[1] = -1;
+	}
+#endif				/* HAVE_SPLICE */
+
+#ifdef HAVE_LINUX_IO_URING_H
+	ring = state->uring;
+	if (NULL == ring)
+		return;
+
+	/*
+	 * Cancel anything left in flight - such as a read from a pipe
+	 * that might never return - and wait for it to come back, giving
+	 * up after a few seconds.
+	 */
+	for (i = 0; i < ring->reads_queued; i++) {
+		pv__uring_queue(ring, IORING_OP_ASYNC_CANCEL, -1,
+				(void *) (unsigned long) (ring->
+							   reads[i].id), 0,
+				0, PV_URING_CANCEL);
+	}
+	if (ring->write_inflight) {
+		pv__uring_queue(ring, IORING_OP_ASYNC_CANCEL, -1,
+				(void *) (unsigned long) PV_URING_WRITE, 0,
+				0, PV_URING_CANCEL);
+	}
+
+	for (attempts = 0;
+	     (attempts < 50) && pv__transfer_uring_busy(state);
+	     attempts++) {
+		if (!ring->timeout_inflight) {
+			if (0 ==
+			    pv__uring_queue(ring, IORING_OP_TIMEOUT, -1,
+					    &(ring->timeout), 1, 1,
+					    PV_URING_TIMEOUT))
+				ring->timeout_inflight = 1;
+		}
+		pv__uring_enter(ring, 1);
+		pv__uring_reap(ring, &write_done);
+		while ((ring->reads_queued > 0)
+		       && (ring->reads[0].complete)) {
+			ring->reads_queued--;
+			memmove(&(ring->reads[0]), &(ring->reads[1]),
+				ring->reads_queued *
+				sizeof(ring->reads[0]));
+		}
+	}
+
+	pv__uring_free(ring);
+	state->uring = NULL;
+#endif				/* HAVE_LINUX_IO_URING_H */
+}
+
+
+/*
+ * In line mode, where "allowed" is a number of lines rather than bytes,
+ * only allow up to the end of the "allowed"th line to be written.
+ */
+static void pv__transfer_linemode_limit(pvstate_t state,
+					unsigned long long allowed)
+{
+	struct iovec iov[2];
+	long to_write;
+	int iovcnt, idx;
+
+	if (state->to_write <= 0)
+		return;
+
+	iovcnt =
+	    pv__transfer_ring_iov(state, state->write_position,
+				  state->to_write, iov);
+	to_write = 0;
+	for (idx = 0; idx < iovcnt; idx++) {
+		to_write +=
+		    pv_count_records(iov[idx].iov_base, iov[idx].iov_len,
+				     state->null ? 0 : '\n', &allowed);
+	}
+	state->to_write = to_write;
+}
+
+
+/*
+ * In line mode, only write up to and including the last line terminator,
+ * so that we're writing output line-by-line.
+ *
+ * Normally, if there is no terminator at all, everything is written
+ * anyway; but when rate limiting, a partial line is held back until the
+ * rest of it arrives, unless the input has ended or the buffer is full.
+ */
+static void pv__transfer_linemode_trim(pvstate_t state, int eof_in)
+{
+	struct iovec iov[2];
+	unsigned char *start;
+	unsigned char line_end;
+	long to_write, offset;
+	int idx;
+
+	if ((state->to_write <= 0) || (!state->linemode))
+		return;
+
+	line_end = state->null ? 0 : '\n';
+
+	/*
+	 * Search backwards from the end of the data, which may wrap around
+	 * the end of the buffer.
+	 */
+	to_write = state->to_write;
+	for (idx =
+	     pv__transfer_ring_iov(state, state->write_position,
+				   state->to_write, iov) - 1; idx >= 0;
+	     idx--) {
+		start = iov[idx].iov_base;
+		for (offset = iov[idx].iov_len - 1; offset >= 0; offset--) {
+			if (line_end == start[offset]) {
+				state->to_write = to_write -
+				    (iov[idx].iov_len - offset) + 1;
+				return;
+			}
+		}
+		to_write -= iov[idx].iov_len;
+	}
+
+	if ((state->rate_limit > 0) && (!eof_in)
+	    && (state->read_position - state->write_position <
+		state->buffer_size))
+		state->to_write = 0;
+}
+
+
 /*
  * Transfer some data from "fd" to standard output, timing out after 9/100
  * of a second.  If state->rate_limit is >0, and/or "allowed" is >0, only up
- * to "allowed" bytes can be written.  The variables that "eof_in" and
- * "eof_out" point to are used to flag that we've finished reading and
- * writing respectively.
+ * to "allowed" bytes - or lines, in line mode - can be written.  The
+ * variables that "eof_in" and "eof_out" point to are used to flag that
+ * we've finished reading and writing respectively.
  *
  * Returns the number of bytes written, or negative on error (in which case
  * state->exit_status is updated). In line mode, the number of lines written
@@ -651,10 +2902,7 @@ static int pv__transfer_write(pvstate_t state, int fd,
 long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 		 unsigned long long allowed, long *lineswritten)
 {
-	struct timeval tv;
-	fd_set readfds;
-	fd_set writefds;
-	int max_fd;
+	struct pollfd pfds[2];
 	int n;
 
 	if (NULL == state)
@@ -670,10 +2918,21 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 		state->read_error_warning_shown = 0;
 	}
 
+	/*
+	 * With O_DIRECT, the buffer size has to be a whole number of
+	 * aligned blocks.
+	 */
+	if ((state->direct_io)
+	    && (0 != (state->target_buffer_size % state->direct_align))) {
+		state->target_buffer_size +=
+		    state->direct_align -
+		    (state->target_buffer_size % state->direct_align);
+	}
+
 	if (NULL == state->transfer_buffer) {
 		state->buffer_size = state->target_buffer_size;
 		state->transfer_buffer =
-		    (unsigned char *) malloc(state->buffer_size + 32);
+		    pv_transfer_buffer_alloc(state, state->buffer_size);
 		if (NULL == state->transfer_buffer) {
 			pv_error(state, "%s: %s",
 				 _("buffer allocation failed"),
@@ -684,25 +2943,53 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 	}
 
 	/*
-	 * Reallocate the buffer if the buffer size has changed mid-transfer.
+	 * Reallocate the buffer if the buffer size has changed mid-transfer,
+	 * once the data still in it will fit in the new size.  Since
+	 * positions in the ring depend on the buffer size, that data is
+	 * moved to the start of the new one.
 	 */
-	if (state->buffer_size < state->target_buffer_size) {
+	if ((state->buffer_size != state->target_buffer_size)
+	    && (state->read_position - state->write_position <=
+		state->target_buffer_size)
+	    && (!pv__transfer_uring_busy(state))) {
 		unsigned char *newptr;
 		newptr =
-		    realloc(state->transfer_buffer,
-			    state->target_buffer_size + 32);
+		    pv_transfer_buffer_alloc(state,
+					     state->target_buffer_size);
 		if (NULL == newptr) {
 			/*
-			 * Reset target if realloc failed so we don't keep
-			 * trying to realloc over and over.
+			 * Reset target if allocation failed so we don't keep
+			 * trying to reallocate over and over.
 			 */
-			debug("realloc: %s", strerror(errno));
+			debug("malloc: %s", strerror(errno));
 			state->target_buffer_size = state->buffer_size;
 		} else {
-			debug("%s: %ld", "buffer resized",
-			      state->buffer_size);
+			struct iovec iov[2];
+			unsigned long long used;
+			int iovcnt, idx;
+
+			used = state->read_position - state->write_position;
+			iovcnt =
+			    pv__transfer_ring_iov(state,
+						  state->write_position, used,
+						  iov);
+			used = 0;
+			for (idx = 0; idx < iovcnt; idx++) {
+				memcpy(newptr + used, iov[idx].iov_base,
+				       iov[idx].iov_len);
+				used += iov[idx].iov_len;
+			}
+
+			pv_transfer_buffer_free(state,
+						state->transfer_buffer,
+						state->buffer_size);
 			state->transfer_buffer = newptr;
 			state->buffer_size = state->target_buffer_size;
+			state->write_position = 0;
+			state->read_position = used;
+
+			debug("%s: %ld", "buffer resized",
+			      state->buffer_size);
 		}
 	}
 
@@ -712,22 +2999,49 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 	if ((*eof_in) && (*eof_out))
 		return 0;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 90000;
-
-	FD_ZERO(&readfds);
-	FD_ZERO(&writefds);
+	/*
+	 * Keep track of how full the buffer gets, and how often it is too
+	 * full to read into, for pv_transfer_buffer_adapt().  A full
+	 * buffer doesn't count if we are holding back output on purpose.
+	 */
+	if (state->buffer_adaptive) {
+		unsigned long long used;
+
+		used = state->read_position - state->write_position;
+		if (used > state->adapt_peak)
+			state->adapt_peak = used;
+		state->adapt_calls++;
+		if ((!(*eof_in)) && (0 == state->rate_limit)
+		    && (!state->stop_at_size)
+		    && (used +
+			((fd == state->direct_input_fd) ?
+			 state->direct_align - 1 : 0)
+			>= state->buffer_size))
+			state->adapt_full++;
+	}
 
-	max_fd = 0;
+	/*
+	 * The first entry is for the input and the second for the output;
+	 * poll() skips entries whose fd is negative, so each one is only
+	 * filled in if we are interested in it.  Unlike select(), poll()
+	 * works with descriptors of any number.
+	 */
+	pfds[0].fd = -1;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	pfds[1].fd = -1;
+	pfds[1].events = POLLOUT;
+	pfds[1].revents = 0;
 
 	/*
 	 * If the input file is not at EOF and there's room in the buffer,
 	 * look for incoming data from it.
 	 */
-	if ((!(*eof_in)) && (state->read_position < state->buffer_size)) {
-		FD_SET(fd, &readfds);
-		if (fd > max_fd)
-			max_fd = fd;
+	if ((!(*eof_in))
+	    && (state->read_position - state->write_position +
+		((fd == state->direct_input_fd) ? state->direct_align - 1 : 0)
+		< state->buffer_size)) {
+		pfds[0].fd = fd;
 	}
 
 	/*
@@ -738,22 +3052,52 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 	 */
 	state->to_write = state->read_position - state->write_position;
 	if ((state->rate_limit > 0) || (allowed > 0)) {
-		if (state->to_write > allowed) {
+		if (state->linemode) {
+			pv__transfer_linemode_limit(state, allowed);
+		} else if (state->to_write > allowed) {
 			state->to_write = allowed;
 		}
 	}
 
+	pv__transfer_direct_output_trim(state, *eof_in);
+
+#ifdef HAVE_SPLICE
+	/*
+	 * If rate limiting means nothing can be sent this time, and the
+	 * buffer is empty so that the next read would be a splice() or
+	 * similar, leave the input alone until there is something to send,
+	 * rather than reading it into the buffer, so that the data can keep
+	 * going straight to the output.
+	 */
+	if ((state->rate_limit > 0) && (0 == allowed)
+	    && (!state->linemode) && (!state->no_splice)
+	    && (!state->direct_io) && (!state->sparse)
+	    && (fd != state->splice_failed_fd)
+	    && (state->read_position == state->write_position)) {
+		pfds[0].fd = -1;
+	}
+#endif				/* HAVE_SPLICE */
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (pv__transfer_uring_ready(state, fd)) {
+		state->written = 0;
+		pv__transfer_linemode_trim(state, *eof_in);
+		if (pv__transfer_uring
+		    (state, fd, eof_in, eof_out, lineswritten) == 0)
+			return 0;
+		return state->written;
+	}
+#endif				/* HAVE_LINUX_IO_URING_H */
+
 	/*
 	 * If we don't think we've finished writing and there's anything
 	 * we're allowed to write, look for the stdout becoming writable.
 	 */
 	if ((!(*eof_out)) && (state->to_write > 0)) {
-		FD_SET(STDOUT_FILENO, &writefds);
-		if (STDOUT_FILENO > max_fd)
-			max_fd = STDOUT_FILENO;
+		pfds[1].fd = STDOUT_FILENO;
 	}
 
-	n = select(max_fd + 1, &readfds, &writefds, NULL, &tv);
+	n = poll(pfds, 2, TRANSFER_READ_TIMEOUT / 1000);
 
 	if (n < 0) {
 		/*
@@ -767,7 +3111,7 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 		 */
 		pv_error(state, "%s: %s: %d: %s",
 			 state->current_file,
-			 _("select call failed"), n, strerror(errno));
+			 _("poll call failed"), n, strerror(errno));
 
 		state->exit_status |= 16;
 
@@ -782,49 +3126,21 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 	 *
 	 * NB this can update state->written because of splice().
 	 */
-	if (FD_ISSET(fd, &readfds)) {
+	if ((pfds[0].fd >= 0) && (0 != pfds[0].revents)) {
 		if (pv__transfer_read
 		    (state, fd, eof_in, eof_out, allowed,
 		     lineswritten) == 0)
 			return 0;
 	}
 
-	/*
-	 * In line mode, only write up to and including the last newline,
-	 * so that we're writing output line-by-line.
-	 */
-	if ((state->to_write > 0) && (state->linemode) && !(state->null)) {
-		/*
-		 * Guillaume Marcais: use strrchr to find last \n
-		 */
-		unsigned char save;
-		char *start;
-		char *end;
-
-		save =
-		    state->transfer_buffer[state->write_position +
-					   state->to_write];
-		state->transfer_buffer[state->write_position +
-				       state->to_write] = 0;
-
-		start =
-		    (char *) (state->transfer_buffer +
-			      state->write_position);
-		end = strrchr(start, '\n');
-		state->transfer_buffer[state->write_position +
-				       state->to_write] = save;
-
-		if (end != NULL) {
-			state->to_write = (end - start) + 1;
-		}
-	}
+	pv__transfer_linemode_trim(state, *eof_in);
 
 	/*
 	 * If there is data to write, and stdout is ready to receive it, and
 	 * we didn't use splice() this time, write some data.  Return early
 	 * if there was a transient write error.
 	 */
-	if (FD_ISSET(STDOUT_FILENO, &writefds)
+	if ((pfds[1].fd >= 0) && (0 != pfds[1].revents)
 #ifdef HAVE_SPLICE
 	    && (0 == state->splice_used)
 #endif				/* HAVE_SPLICE */
@@ -834,27 +3150,6 @@ long pv_transfer(pvstate_t state, int fd, int *eof_in, int *eof_out,
 		    (state, fd, eof_in, eof_out, lineswritten) == 0)
 			return 0;
 	}
-#ifdef MAXIMISE_BUFFER_FILL
-	/*
-	 * Rotate the written bytes out of the buffer so that it can be
-	 * filled up completely by the next read.
-	 */
-	if (state->write_position > 0) {
-		if (state->write_position < state->read_position) {
-			memmove(state->transfer_buffer,
-				state->transfer_buffer +
-				state->write_position,
-				state->read_position -
-				state->write_position);
-			state->read_position -= state->write_position;
-			state->write_position = 0;
-		} else {
-			state->write_position = 0;
-			state->read_position = 0;
-		}
-	}
-#endif				/* MAXIMISE_BUFFER_FILL */
-
 	return state->written;
 }
 
@@ -166,7 +166,9 @@ long long pv_watchfd_position(pvwatchfd_t info)
 
 /*
  * Scan the given process and update the arrays with any new file
- * descriptors.
+ * descriptors.  The array mapping file descriptors to array indexes, whose
+ * length is *fd_to_idx_length_ptr, is extended as needed, so that there is
+ * no limit on the file descriptor numbers that can be watched.
  *
  * Returns 0 on success, 1 if the process no longer exists or could not be
  * read, or 2 for a memory allocation error.
@@ -174,7 +176,8 @@ long long pv_watchfd_position(pvwatchfd_t info)
 int pv_watchpid_scanfds(pvstate_t state, pvstate_t pristine,
 			unsigned int watch_pid, int *array_length_ptr,
 			pvwatchfd_t * info_array_ptr,
-			pvstate_t * state_array_ptr, int *fd_to_idx)
+			pvstate_t * state_array_ptr, int **fd_to_idx_ptr,
+			int *fd_to_idx_length_ptr)
 {
 	char fd_dir[512] = { 0, };
 	DIR *dptr;
@@ -182,6 +185,7 @@ int pv_watchpid_scanfds(pvstate_t state, pvstate_t pristine,
 	int array_length = 0;
 	struct pvwatchfd_s *info_array = NULL;
 	struct pvstate_s *state_array = NULL;
+	int *fd_to_idx;
 
 	snprintf(fd_dir, sizeof(fd_dir) - 1, "/proc/%u/fd", watch_pid);
 	dptr = opendir(fd_dir);
@@ -191,6 +195,7 @@ int pv_watchpid_scanfds(pvstate_t state, pvstate_t pristine,
 	array_length = *array_length_ptr;
 	info_array = *info_array_ptr;
 	state_array = *state_array_ptr;
+	fd_to_idx = *fd_to_idx_ptr;
 
 	while ((d = readdir(dptr)) != NULL) {
 		int fd, check_idx, use_idx, rc;
@@ -199,9 +204,40 @@ int pv_watchpid_scanfds(pvstate_t state, pvstate_t pristine,
 		fd = -1;
 		if (sscanf(d->d_name, "%d", &fd) != 1)
 			continue;
-		if ((fd < 0) || (fd >= FD_SETSIZE))
+		if (fd < 0)
 			continue;
 
+		/*
+		 * Extend the fd to index map if this fd is beyond the end
+		 * of it, at least doubling it so that we don't have to do
+		 * this too often.
+		 */
+		if (fd >= *fd_to_idx_length_ptr) {
+			int *new_fd_to_idx;
+			int new_length, idx;
+
+			new_length = *fd_to_idx_length_ptr * 2;
+			if (new_length < 64)
+				new_length = 64;
+			if (new_length <= fd)
+				new_length = fd + 1;
+
+			new_fd_to_idx =
+			    realloc(fd_to_idx,
+				    new_length * sizeof(*fd_to_idx));
+			if (NULL == new_fd_to_idx) {
+				closedir(dptr);
+				return 2;
+			}
+			for (idx = *fd_to_idx_length_ptr; idx < new_length;
+			     idx++)
+				new_fd_to_idx[idx] = -1;
+
+			fd_to_idx = new_fd_to_idx;
+			*fd_to_idx_ptr = fd_to_idx;
+			*fd_to_idx_length_ptr = new_length;
+		}
+
 		/*
 		 * Skip if this fd is already known to us.
 		 */
@@ -330,7 +366,7 @@ int pv_watchpid_scanfds(pvstate_t state, pvstate_t pristine,
 
 		state_array[use_idx].reparse_display = 1;
 
-		gettimeofday(&(info_array[use_idx].start_time), NULL);
+		pv_monotonic_time(&(info_array[use_idx].start_time));
 
 		state_array[use_idx].initial_offset = 0;
 		info_array[use_idx].position = 0;